@@ -9,18 +9,57 @@
 #include <chrono>
 #include <thread>
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <map>
+#include <csignal>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <glob.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ASCII_X86
+#include <immintrin.h>
+#endif
+
+//Build with -DASCII_LIBJPEG and -ljpeg ('make JPEG=1') to decode JPEGs at reduced scale through libjpeg
+#ifdef ASCII_LIBJPEG
+#include <csetjmp>
+#include <cstdio>
+#include <jpeglib.h>
+#endif
 
 #define STB_IMAGE_IMPLEMENTATION
 #define STB_IMAGE_RESIZE_IMPLEMENTATION
 #include "lib/stb_image.h"
 #include "lib/stb_image_resize2.h"
+#include "glyphsmith.h"
 
 using namespace std;
 using namespace chrono;
 
 //Constants
 const string fontsizesFile = "charsizes.txt";
-const float framerate = 15.0;
+const string streamName = "-";   //As input or output file: stdin or stdout
+const float cellAspect = 0.442f; //Width / height of a terminal character cell
+const int pipelineDepth = 3;     //Encoded frames that may wait for the terminal during --rotate
+const size_t bandBytes = 64 * 1024; //Pixel rows per band of work are picked to stay within this many bytes
+const int areaDownscaleRatio = 8; //Shrinking by at least this much in both directions averages areas instead of resampling
+const int serveBacklog = 64;     //Connections --serve lets wait for a worker before accept() blocks
+const size_t maxRequestHeader = 1024;
+const size_t maxRequestBytes = 256 * 1024 * 1024;
+const int maxRequestWidth = 4096; //Widest art a --serve request may ask for
+const int serveIdleSeconds = 10; //A --serve worker drops a client that sends nothing for this long
+const int maxColorTolerance = 765; //Largest distance between two RGB colours
 
 //Checks if a path is relative or absolute. If relative, appends it to current working directory path
 string get_full_image_path(const string& filename) 
@@ -47,12 +86,36 @@ const bool verboseDefault = false;
 const int no_of_ascii_default = 4;
 const bool invertDefault = false;
 const bool terminalDefault = false;
+const bool antialiasDefault = false;
 const bool doOutputDefault = true;
 const float rotateSpeedDefault = 0.0f;
-const int rotations = 1;
+const float fpsDefault = 15.0f;
+const int rotationsDefault = 1;
+const int cacheMBDefault = 64;
+const int threadsDefault = 1;
+const int colorToleranceDefault = 0;
+
+//Colour escapes used in terminal mode
+enum color_mode{
+    truecolor, //24 bit "ESC[38;2;R;G;Bm"
+    ansi256,   //xterm-256 "ESC[38;5;Nm"
+    ansi16,    //Basic "ESC[3Nm" and bright "ESC[9Nm"
+};
+const color_mode colorsDefault = truecolor;
 
 string ascii_chars; //Palette of characters for art, sorted in order of decreasing brightness (gets reversed when invert is true)
 
+//Fixed-point (Q15) luminance weights for 0.299, 0.587 and 0.114. They sum to exactly 1 << 15 so white stays 255
+const int lumaShift = 15;
+const int lumaR = 9798;
+const int lumaG = 19235;
+const int lumaB = 3735;
+
+//ascii_chars compiled into a lookup table, so that the per-pixel work is one multiply-add and a table load
+struct palette{
+    char glyphs[256]; //Grayscale value -> character
+};
+
 //Contains all configurations the user can alter using arguments
 struct config{
     string filename;
@@ -66,6 +129,15 @@ struct config{
     int resY;
     int channels;
     float rotateSpeed;
+    float fps;
+    int rotations;
+    int cacheMB;
+    int threads;
+    string batch;    //Directory, glob or manifest of images to convert, empty for a single image
+    string socket;   //Unix socket to serve render requests on, empty to render once
+    bool antialias;
+    int colorTolerance;
+    color_mode colors;
 
     // Constructor to initialize the default values
     config(): 
@@ -77,7 +149,14 @@ struct config{
         invert(invertDefault),
         terminal(terminalDefault),
         output(doOutputDefault),
-        rotateSpeed(rotateSpeedDefault) {}
+        rotateSpeed(rotateSpeedDefault),
+        fps(fpsDefault),
+        rotations(rotationsDefault),
+        cacheMB(cacheMBDefault),
+        threads(threadsDefault),
+        antialias(antialiasDefault),
+        colorTolerance(colorToleranceDefault),
+        colors(colorsDefault) {}
 };
 
 //Return status of parse_args. 
@@ -92,16 +171,35 @@ void print_help() {
     cout << "Usage: ascii_art [options]\n"
          << "Options:\n"
          << "  -h,              --help                  Show this help message and exit\n"
-         << "  -f FILE,         --file FILE             Input image file (default: "<< imagefileDefault <<")\n"
+         << "  -f FILE,         --file FILE             Input image file, - for stdin (default: "<< imagefileDefault <<")\n"
          << "  -w RES,          --width RES             Horizontal resolution of ASCII art in characters(default: "<< resXDefault <<")\n"
-         << "  -o FILE,         --output FILE           Output ASCII art file (default: "<< outputDefault << ")\n"
+         << "  -o FILE,         --output FILE           Output ASCII art file, - for stdout (default: "<< outputDefault << ")\n"
          << "  -v,              --verbose               Do verbose logging (default: " << ((verboseDefault)?("true"):("false")) << ")\n"
          << "  -#,              --no_of_chars           Amount of ascii characters to use (default: "<< no_of_ascii_default <<")\n"
          << "  -i,              --invert                Inverts brightness values(default:"<< ((invertDefault)?("true"):("false")) << ")\n"
          << "  -c,              --chars                 Ascii characters to use. Overrides default ascii character selection (default: none)\n"
          << "  -t,              --terminal              Output to terminal aswell as output file(default:"<< ((invertDefault)?("true"):("false")) <<")\n"
+         << "                                                  - Without it the image is resized as luminance only, so a few glyphs\n"
+         << "                                                    of the output file can differ from a run with -t\n"
          << "  -r SPEED,        --rotate SPEED          Sets rotations per second to SPEED (default:"<< rotateSpeedDefault <<")\n"
-         << "                                                  - Also enables terminal output and disables file output\n";
+         << "                                                  - Also enables terminal output and disables file output\n"
+         << "  -F FPS,          --fps FPS               Frames per second of the rotation; late frames are dropped (default: "<< fpsDefault <<")\n"
+         << "  -n COUNT,        --revolutions COUNT     Number of revolutions to rotate, 0 to loop forever (default: "<< rotationsDefault <<")\n"
+         << "  -m MB,           --cache-mb MB           Memory for replaying rotation frames after the first revolution, 0 to disable (default: "<< cacheMBDefault <<")\n"
+         << "  -j N,            --threads N             Threads to render with, 0 for one per core (default: "<< threadsDefault <<")\n"
+         << "  -b SPEC,         --batch SPEC            Convert every image of a directory, a glob (quoted) or a manifest file in one\n"
+         << "                                                  process, on --threads threads. Manifest lines are 'input [output]';\n"
+         << "                                                  other images are written to output/<name>.txt\n"
+         << "  -S PATH,         --serve PATH            Serve render requests on the Unix socket PATH with --threads workers. A request is\n"
+         << "                                                  the line 'size=BYTES [width=N] [chars=N] [invert=0|1] [colors=none|16|256|truecolor]\n"
+         << "                                                  [tolerance=DIST]' and BYTES of encoded image; the answer is 'ok LENGTH' or\n"
+         << "                                                  'error MESSAGE' and LENGTH bytes of ASCII art. Unset options default to the command line,\n"
+         << "                                                  colours included: plain text unless -t is given. A worker stays with one client until\n"
+         << "                                                  it hangs up or neither sends nor reads for " << serveIdleSeconds << " s\n"
+         << "  -a,              --antialias             Rotate from the source image with mip-mapped, aspect-correct filtering (default: "<< ((antialiasDefault)?("true"):("false")) <<")\n"
+         << "  -T DIST,         --color-tolerance DIST  Reuse the active terminal colour for cells within perceptual distance DIST (default: "<< colorToleranceDefault <<")\n"
+         << "                                                  - DIST is in RGB units (0-765), 0 only reuses exact matches. Truecolor only\n"
+         << "  -C MODE,         --colors MODE           Terminal colours: 16, 256 or truecolor (default: truecolor)\n";
     return;
 }
 
@@ -114,7 +212,7 @@ status parse_args(config &settings, int argc, char* argv[]) {
             return h;
 
         } else if (arg == "--file" || arg == "-f") {
-            if (i + 1 < argc) settings.filename = get_full_image_path(argv[++i]);
+            if (i + 1 < argc) settings.filename = (argv[++i] == streamName) ? streamName : get_full_image_path(argv[i]);
             else { cerr << "Error: No file specified after " << arg << '\n'; return err; }
 
         } else if (arg == "--width" || arg == "-w") {
@@ -122,7 +220,7 @@ status parse_args(config &settings, int argc, char* argv[]) {
             else { cerr << "Error: No resolution specified after " << arg << '\n'; return err; }
 
         } else if (arg == "--output" || arg == "-o") {
-            if (i + 1 < argc) settings.output_file = "output/" + string(argv[++i]);
+            if (i + 1 < argc) settings.output_file = (argv[++i] == streamName) ? streamName : "output/" + string(argv[i]);
             else { cerr << "Error: No output file specified after " << arg << '\n'; return err; }
 
         } else if (arg == "--verbose" || arg == "-v") {
@@ -147,10 +245,57 @@ status parse_args(config &settings, int argc, char* argv[]) {
             else { cerr << "Error: No speed specified after " << arg << '\n'; return err; }
             settings.terminal= true;
             settings.output = false;
+        } else if(arg == "--fps" || arg == "-F") {
+            if (i + 1 < argc) settings.fps = stof(argv[++i]);
+            else { cerr << "Error: No framerate specified after " << arg << '\n'; return err; }
+            if (settings.fps <= 0) { cerr << "Error: Framerate must be positive" << '\n'; return err; }
+        } else if(arg == "--revolutions" || arg == "-n") {
+            if (i + 1 < argc) settings.rotations = stoi(argv[++i]);
+            else { cerr << "Error: No count specified after " << arg << '\n'; return err; }
+            if (settings.rotations < 0) { cerr << "Error: Revolution count can't be negative" << '\n'; return err; }
+        } else if(arg == "--threads" || arg == "-j") {
+            if (i + 1 < argc) settings.threads = stoi(argv[++i]);
+            else { cerr << "Error: No thread count specified after " << arg << '\n'; return err; }
+            if (settings.threads < 0) { cerr << "Error: Thread count can't be negative" << '\n'; return err; }
+            if (settings.threads == 0) settings.threads = max(1u, thread::hardware_concurrency());
+        } else if(arg == "--batch" || arg == "-b") {
+            if (i + 1 < argc) settings.batch = argv[++i];
+            else { cerr << "Error: No batch specified after " << arg << '\n'; return err; }
+        } else if(arg == "--serve" || arg == "-S") {
+            if (i + 1 < argc) settings.socket = argv[++i];
+            else { cerr << "Error: No socket specified after " << arg << '\n'; return err; }
+        } else if(arg == "--cache-mb" || arg == "-m") {
+            if (i + 1 < argc) settings.cacheMB = stoi(argv[++i]);
+            else { cerr << "Error: No size specified after " << arg << '\n'; return err; }
+            if (settings.cacheMB < 0) { cerr << "Error: Cache size can't be negative" << '\n'; return err; }
+        } else if(arg == "--antialias" || arg == "-a") {
+            settings.antialias = true;
+        } else if(arg == "--color-tolerance" || arg == "-T") {
+            if (i + 1 < argc) settings.colorTolerance = stoi(argv[++i]);
+            else { cerr << "Error: No distance specified after " << arg << '\n'; return err; }
+            if (settings.colorTolerance < 0 || settings.colorTolerance > maxColorTolerance) {
+                cerr << "Error: Colour tolerance must be between 0 and " << maxColorTolerance << '\n'; return err;
+            }
+        } else if(arg == "--colors" || arg == "-C") {
+            if (i + 1 >= argc) { cerr << "Error: No colour mode specified after " << arg << '\n'; return err; }
+            string mode = argv[++i];
+            if (mode == "truecolor") settings.colors = truecolor;
+            else if (mode == "256") settings.colors = ansi256;
+            else if (mode == "16") settings.colors = ansi16;
+            else { cerr << "Error: Unknown colour mode " << mode << '\n'; return err; }
         } else {
             cerr << "Error: Unknown argument " << arg << '\n'; return err;
         }
     }
+    if (settings.output && settings.terminal && settings.output_file == streamName) {
+        cerr << "Error: Output to stdout can't be combined with terminal output" << '\n'; return err;
+    }
+    if (!settings.batch.empty() && settings.terminal) {
+        cerr << "Error: Batch mode only writes files, it can't be combined with terminal output or rotation" << '\n'; return err;
+    }
+    if (!settings.socket.empty() && (settings.rotateSpeed > 0 || !settings.batch.empty())) {
+        cerr << "Error: --serve can't be combined with rotation or batch mode" << '\n'; return err;
+    }
     return def;
 }
 
@@ -210,11 +355,27 @@ char find_nearest(vector<pair<char, int> > data, int ideal) {
     return best;
 }
 
-//Figures out string of characters to use as palette of length 'chars' 
-string figure_out_chars(int chars) {
+//fontsizesFile as shipped, for the library, which must not depend on the working directory
+const pair<char, int> builtinCoverage[] = {
+    {'$', 3334}, {'M', 3299}, {'Q', 3240}, {'B', 3174}, {'%', 3161}, {'W', 3124}, {'0', 3098}, {'8', 2994},
+    {'&', 2987}, {'g', 2962}, {'@', 2932}, {'N', 2895}, {'D', 2862}, {'R', 2815}, {'G', 2813}, {'O', 2794},
+    {'#', 2725}, {'S', 2609}, {'H', 2592}, {'b', 2556}, {'d', 2550}, {'m', 2533}, {'5', 2525}, {'K', 2516},
+    {'q', 2505}, {'p', 2505}, {'U', 2444}, {'E', 2432}, {'3', 2424}, {'w', 2420}, {'P', 2402}, {'C', 2342},
+    {'A', 2338}, {'Z', 2302}, {'6', 2288}, {'9', 2281}, {'X', 2280}, {'e', 2189}, {'2', 2188}, {'a', 2159},
+    {'h', 2155}, {'k', 2123}, {'o', 2030}, {'V', 2023}, {'1', 1990}, {'F', 1954}, {'4', 1909}, {'J', 1877},
+    {'u', 1863}, {'n', 1863}, {'y', 1857}, {'*', 1842}, {'s', 1827}, {'j', 1820}, {'I', 1803}, {'f', 1777},
+    {'Y', 1753}, {'l', 1718}, {'i', 1678}, {'c', 1677}, {'r', 1674}, {'7', 1657}, {'T', 1653}, {'x', 1652},
+    {'z', 1651}, {'t', 1645}, {'?', 1574}, {'}', 1541}, {'{', 1541}, {'L', 1530}, {']', 1508}, {'[', 1508},
+    {'v', 1477}, {'=', 1324}, {'+', 1269}, {'|', 1247}, {')', 1222}, {'(', 1222}, {'<', 1135}, {'>', 1134},
+    {'/', 1131}, {'!', 1037}, {';', 1034}, {'"', 1016}, {':', 945}, {'~', 895}, {'^', 891}, {'-', 673}, {'_', 571},
+    {',', 561}, {'\'', 511}, {'.', 473}, {'`', 294}, {' ', 0}
+};
+const int maxGlyphs = sizeof(builtinCoverage) / sizeof(builtinCoverage[0]); //Most glyphs a palette can be picked from
+
+//Figures out string of characters to use as palette of length 'chars' from 'char_coverages'
+string pick_chars(const vector<pair<char, int> >& char_coverages, int chars) {
     string res = "";
     
-    vector<pair<char, int> > char_coverages = read_char_coverage();
     const int max = char_coverages.at(0).second; //Its sorted to the first element is the highest one
     const int ideal_val_const = max / (chars - 1); //We loop 0 through chars-1, so chars-1 must correspond to max
     
@@ -224,28 +385,577 @@ string figure_out_chars(int chars) {
     return res;
 }
 
-//Loads and processess image into 'data_out' according to 'settings'
-status load_and_process_image(config& settings, unsigned char** data_out) {
-    int width, height, channels;
+//Figures out string of characters to use as palette of length 'chars' from fontsizesFile
+string figure_out_chars(int chars) {
+    return pick_chars(read_char_coverage(), chars);
+}
 
-    string full_image_path = get_full_image_path(settings.filename);
+//Compiles 'chars' into a palette. Must be called after the final character order is known (--chars, --invert)
+palette compile_palette(const string& chars) {
+    palette pal;
+    for (int v = 0; v < 256; v++) pal.glyphs[v] = chars[v * chars.size() / 256];
+    return pal;
+}
 
-    // Load image
-    unsigned char* data_tmp = stbi_load(full_image_path.c_str(), &width, &height, &channels, 0);
+//Converts a row of 'count' interleaved pixels with 'channels' bytes each into grayscale bytes
+typedef void (*luma_kernel)(const unsigned char* src, unsigned char* gray, int count, int channels);
 
-    if (!data_tmp) {
-        cerr << "Failed to load image: " << full_image_path << '\n';
-        return err;
+//Portable fallback, also used for the tail of every SIMD row
+void luma_row_scalar(const unsigned char* src, unsigned char* gray, int count, int channels) {
+    if (channels < 3) { //Gray (+ alpha): the first byte already is the luminance
+        for (int i = 0; i < count; i++) gray[i] = src[i * channels];
+        return;
     }
-    if (settings.verbose) cout << "Image successfully loaded" << '\n';
+    for (int i = 0; i < count; i++, src += channels)
+        gray[i] = static_cast<unsigned char>((lumaR * src[0] + lumaG * src[1] + lumaB * src[2]) >> lumaShift);
+}
 
-    // Compute new vertical while maintaining aspect ratio
-    settings.resY = static_cast<int>(settings.resX * (static_cast<float>(height) / width) * 0.442);
-    settings.channels = channels;
-    //*data_out = (unsigned char*)malloc(settings.resX * settings.resY * comps);
-    *data_out = (unsigned char*)malloc(settings.resX * settings.resY * channels);
+#ifdef ASCII_X86
+//Luminance of 4 RGBx pixels as 32 bit integers
+static inline __m128i luma4_sse2(__m128i px) {
+    const __m128i weights = _mm_setr_epi16(lumaR, lumaG, lumaB, 0, lumaR, lumaG, lumaB, 0);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(px, zero), weights); //[p0 rg, p0 b, p1 rg, p1 b]
+    __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(px, zero), weights); //[p2 rg, p2 b, p3 rg, p3 b]
+    __m128 even = _mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(2, 0, 2, 0));
+    __m128 odd = _mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(3, 1, 3, 1));
+    return _mm_srli_epi32(_mm_add_epi32(_mm_castps_si128(even), _mm_castps_si128(odd)), lumaShift);
+}
+
+//Spreads the 4 RGB pixels in the low 12 bytes of 'v' out to RGBx with x = 0. SSE2 has no byte shuffle, so shift and mask
+static inline __m128i rgb_to_rgbx_sse2(__m128i v) {
+    const __m128i m0 = _mm_setr_epi8(-1, -1, -1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i m1 = _mm_slli_si128(m0, 4), m2 = _mm_slli_si128(m0, 8), m3 = _mm_slli_si128(m0, 12);
+    __m128i res = _mm_and_si128(v, m0);
+    res = _mm_or_si128(res, _mm_and_si128(_mm_slli_si128(v, 1), m1));
+    res = _mm_or_si128(res, _mm_and_si128(_mm_slli_si128(v, 2), m2));
+    return _mm_or_si128(res, _mm_and_si128(_mm_slli_si128(v, 3), m3));
+}
+
+//16 pixels per iteration. RGB loads read 4 bytes past the last pixel they use, so they stop early and leave the rest to scalar
+void luma_row_sse2(const unsigned char* src, unsigned char* gray, int count, int channels) {
+    int i = 0;
+    if (channels == 4) {
+        for (; i + 16 <= count; i += 16) {
+            const unsigned char* p = src + i * 4;
+            __m128i a = luma4_sse2(_mm_loadu_si128((const __m128i*)p));
+            __m128i b = luma4_sse2(_mm_loadu_si128((const __m128i*)(p + 16)));
+            __m128i c = luma4_sse2(_mm_loadu_si128((const __m128i*)(p + 32)));
+            __m128i d = luma4_sse2(_mm_loadu_si128((const __m128i*)(p + 48)));
+            _mm_storeu_si128((__m128i*)(gray + i), _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d)));
+        }
+    } else if (channels == 3) {
+        for (; (i + 16) * 3 + 4 <= count * 3; i += 16) {
+            const unsigned char* p = src + i * 3;
+            __m128i a = luma4_sse2(rgb_to_rgbx_sse2(_mm_loadu_si128((const __m128i*)p)));
+            __m128i b = luma4_sse2(rgb_to_rgbx_sse2(_mm_loadu_si128((const __m128i*)(p + 12))));
+            __m128i c = luma4_sse2(rgb_to_rgbx_sse2(_mm_loadu_si128((const __m128i*)(p + 24))));
+            __m128i d = luma4_sse2(rgb_to_rgbx_sse2(_mm_loadu_si128((const __m128i*)(p + 36))));
+            _mm_storeu_si128((__m128i*)(gray + i), _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d)));
+        }
+    }
+    luma_row_scalar(src + i * channels, gray + i, count - i, channels);
+}
+
+//Luminance of 8 RGBx pixels as 32 bit integers, in order
+__attribute__((target("avx2"))) static inline __m256i luma8_avx2(__m256i px) {
+    const __m256i weights = _mm256_setr_epi16(lumaR, lumaG, lumaB, 0, lumaR, lumaG, lumaB, 0,
+                                              lumaR, lumaG, lumaB, 0, lumaR, lumaG, lumaB, 0);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i lo = _mm256_madd_epi16(_mm256_unpacklo_epi8(px, zero), weights); //p0 p1 | p4 p5
+    __m256i hi = _mm256_madd_epi16(_mm256_unpackhi_epi8(px, zero), weights); //p2 p3 | p6 p7
+    return _mm256_srli_epi32(_mm256_hadd_epi32(lo, hi), lumaShift);
+}
+
+//Loads 8 RGB pixels (reading 4 bytes past them) as RGBx
+__attribute__((target("avx2"))) static inline __m256i load_rgb8_avx2(const unsigned char* p) {
+    const __m256i spread = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+                                            0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)p)),
+                                        _mm_loadu_si128((const __m128i*)(p + 12)), 1);
+    return _mm256_shuffle_epi8(v, spread);
+}
+
+//Packs 16 luminance values (two sets of 8 int32) into 16 bytes
+__attribute__((target("avx2"))) static inline void store16_avx2(unsigned char* dst, __m256i a, __m256i b) {
+    __m256i words = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+    _mm_storeu_si128((__m128i*)dst, _mm_packus_epi16(_mm256_castsi256_si128(words), _mm256_extracti128_si256(words, 1)));
+}
+
+__attribute__((target("avx2"))) void luma_row_avx2(const unsigned char* src, unsigned char* gray, int count, int channels) {
+    int i = 0;
+    if (channels == 4) {
+        for (; i + 16 <= count; i += 16) {
+            const unsigned char* p = src + i * 4;
+            store16_avx2(gray + i, luma8_avx2(_mm256_loadu_si256((const __m256i*)p)),
+                                   luma8_avx2(_mm256_loadu_si256((const __m256i*)(p + 32))));
+        }
+    } else if (channels == 3) {
+        for (; (i + 16) * 3 + 4 <= count * 3; i += 16) {
+            const unsigned char* p = src + i * 3;
+            store16_avx2(gray + i, luma8_avx2(load_rgb8_avx2(p)), luma8_avx2(load_rgb8_avx2(p + 24)));
+        }
+    }
+    luma_row_scalar(src + i * channels, gray + i, count - i, channels);
+}
+#endif
+
+//Picks the widest luminance kernel this CPU supports
+luma_kernel select_luma_kernel() {
+#ifdef ASCII_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return luma_row_avx2;
+    if (__builtin_cpu_supports("sse2")) return luma_row_sse2;
+#endif
+    return luma_row_scalar;
+}
+
+const luma_kernel luma_row = select_luma_kernel();
+
+//Maps a row of pixels to characters. 'gray' is scratch space of at least 'count' bytes
+void map_row(const palette& pal, const unsigned char* src, unsigned char* gray, char* out, int count, int channels) {
+    if (channels == 1) { //Already luminance
+        for (int i = 0; i < count; i++) out[i] = pal.glyphs[src[i]];
+        return;
+    }
+    luma_row(src, gray, count, channels);
+    for (int i = 0; i < count; i++) out[i] = pal.glyphs[gray[i]];
+}
+
+//One level of a mip pyramid
+struct mip_level{
+    int width;
+    int height;
+    vector<unsigned char> pixels;
+};
+
+//The decoded image, successively halved, for sampling rotated frames at source resolution. The output footprint is
+//fixed, so only the level with about one texel per cell is kept and memory and sampling cost follow the output size
+struct mip_pyramid{
+    int source_width = 0;
+    int source_height = 0;
+    int channels = 0;
+    int level_index = 0; //How many times 'level' was halved from the source
+    mip_level level;
+};
+
+//2x2 box filter of 'src' into a level of half its size
+mip_level halve_level(const mip_level& src, int channels) {
+    mip_level dst;
+    dst.width = max(1, src.width / 2);
+    dst.height = max(1, src.height / 2);
+    dst.pixels.resize(static_cast<size_t>(dst.width) * dst.height * channels);
+    for (int y = 0; y < dst.height; y++) {
+        const unsigned char* row0 = &src.pixels[static_cast<size_t>(min(2 * y, src.height - 1)) * src.width * channels];
+        const unsigned char* row1 = &src.pixels[static_cast<size_t>(min(2 * y + 1, src.height - 1)) * src.width * channels];
+        unsigned char* out = &dst.pixels[static_cast<size_t>(y) * dst.width * channels];
+        for (int x = 0; x < dst.width; x++) {
+            const int x0 = min(2 * x, src.width - 1) * channels, x1 = min(2 * x + 1, src.width - 1) * channels;
+            for (int c = 0; c < channels; c++)
+                *out++ = static_cast<unsigned char>((row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) >> 2);
+        }
+    }
+    return dst;
+}
+
+//Builds the pyramid for an image of 'width' x 'height' that will be shown in a 'resX' x 'resY' cell grid
+void build_mip_pyramid(const unsigned char* data, int width, int height, int channels, int resX, int resY, mip_pyramid& pyramid) {
+    pyramid.source_width = width;
+    pyramid.source_height = height;
+    pyramid.channels = channels;
+
+    //Cells are taller than wide, so use the geometric mean of the cell footprint in source pixels
+    const double footprint = sqrt((static_cast<double>(width) / resX) * (static_cast<double>(height) / resY));
+    pyramid.level_index = max(0, static_cast<int>(floor(log2(footprint))));
+
+    mip_level& level = pyramid.level;
+    level.width = width;
+    level.height = height;
+    level.pixels.assign(data, data + static_cast<size_t>(width) * height * channels);
+    for (int l = 0; l < pyramid.level_index; l++) level = halve_level(level, channels);
+}
+
+//Adds a row of 'count' bytes to 32 bit running sums
+typedef void (*accumulate_kernel)(const unsigned char* src, unsigned int* sums, int count);
+
+void accumulate_row_scalar(const unsigned char* src, unsigned int* sums, int count) {
+    for (int i = 0; i < count; i++) sums[i] += src[i];
+}
+
+#ifdef ASCII_X86
+//16 bytes per iteration, widened to 32 bits in two unpack steps
+void accumulate_row_sse2(const unsigned char* src, unsigned int* sums, int count) {
+    const __m128i zero = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i lo = _mm_unpacklo_epi8(v, zero), hi = _mm_unpackhi_epi8(v, zero);
+        __m128i* s = (__m128i*)(sums + i);
+        _mm_storeu_si128(s, _mm_add_epi32(_mm_loadu_si128(s), _mm_unpacklo_epi16(lo, zero)));
+        _mm_storeu_si128(s + 1, _mm_add_epi32(_mm_loadu_si128(s + 1), _mm_unpackhi_epi16(lo, zero)));
+        _mm_storeu_si128(s + 2, _mm_add_epi32(_mm_loadu_si128(s + 2), _mm_unpacklo_epi16(hi, zero)));
+        _mm_storeu_si128(s + 3, _mm_add_epi32(_mm_loadu_si128(s + 3), _mm_unpackhi_epi16(hi, zero)));
+    }
+    accumulate_row_scalar(src + i, sums + i, count - i);
+}
+
+__attribute__((target("avx2"))) void accumulate_row_avx2(const unsigned char* src, unsigned int* sums, int count) {
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m256i lo = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src + i)));
+        __m256i hi = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src + i + 8)));
+        __m256i* s = (__m256i*)(sums + i);
+        _mm256_storeu_si256(s, _mm256_add_epi32(_mm256_loadu_si256(s), lo));
+        _mm256_storeu_si256(s + 1, _mm256_add_epi32(_mm256_loadu_si256(s + 1), hi));
+    }
+    accumulate_row_scalar(src + i, sums + i, count - i);
+}
+#endif
+
+//Picks the widest accumulation kernel this CPU supports
+accumulate_kernel select_accumulate_kernel() {
+#ifdef ASCII_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return accumulate_row_avx2;
+    if (__builtin_cpu_supports("sse2")) return accumulate_row_sse2;
+#endif
+    return accumulate_row_scalar;
+}
+
+const accumulate_kernel accumulate_row = select_accumulate_kernel();
+
+//Persistent worker threads for --threads. The thread that calls run_tasks works along, so a pool for N threads has
+//N - 1 workers; with none, tasks simply run inline. Only one thread may use a pool at a time
+struct thread_pool{
+    vector<thread> workers;
+    mutex lock;
+    condition_variable wake;      //Workers wait here for the next job
+    condition_variable finished;  //run_tasks waits here for the workers
+    void (*job)(const void* context, int task) = nullptr; //The callable of run_tasks, without type erasure on the heap
+    const void* context = nullptr;
+    int tasks = 0;
+    atomic<int> next{0};          //Next task to hand out
+    int busy = 0;                 //Workers not yet done with the current job
+    long generation = 0;          //Bumped for every job
+    bool stopping = false;
+
+    ~thread_pool() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (thread& worker : workers) worker.join();
+    }
+};
+
+//Worker loop: takes tasks of each new job until none are left
+void pool_worker(thread_pool& pool) {
+    long seen = 0;
+    unique_lock<mutex> guard(pool.lock);
+    while (true) {
+        pool.wake.wait(guard, [&] { return pool.stopping || pool.generation != seen; });
+        if (pool.stopping) return;
+        seen = pool.generation;
+        guard.unlock();
+        for (int task; (task = pool.next.fetch_add(1)) < pool.tasks; ) pool.job(pool.context, task);
+        guard.lock();
+        if (--pool.busy == 0) pool.finished.notify_one();
+    }
+}
+
+//Gives 'pool' enough workers to run on 'threads' threads in total
+void start_pool(thread_pool& pool, int threads) {
+    while (static_cast<int>(pool.workers.size()) < threads - 1) pool.workers.emplace_back(pool_worker, ref(pool));
+}
+
+//Runs job(0) ... job(tasks - 1) on 'pool' and returns once all of them are done. Workers call 'job' through a plain
+//function pointer, so running a job never allocates
+template <typename F>
+void run_tasks(thread_pool& pool, int tasks, const F& job) {
+    if (pool.workers.empty() || tasks <= 1) {
+        for (int task = 0; task < tasks; task++) job(task);
+        return;
+    }
+    {
+        lock_guard<mutex> guard(pool.lock);
+        pool.job = [](const void* context, int task) { (*static_cast<const F*>(context))(task); };
+        pool.context = &job;
+        pool.tasks = tasks;
+        pool.next = 0;
+        pool.busy = static_cast<int>(pool.workers.size());
+        pool.generation++;
+    }
+    pool.wake.notify_all();
+    for (int task; (task = pool.next.fetch_add(1)) < tasks; ) job(task);
+    unique_lock<mutex> guard(pool.lock);
+    pool.finished.wait(guard, [&] { return pool.busy == 0; });
+}
+
+thread_pool pool; //Renders frames, see --threads
+
+//Rows per band when 'rows' rows of 'row_bytes' each are split up: a band stays within bandBytes so it is worked on in
+//cache, and there are at least two bands per thread so that uneven bands still balance. Without workers it is one band
+int band_rows(int rows, size_t row_bytes) {
+    if (pool.workers.empty()) return max(rows, 1);
+    const int threads = static_cast<int>(pool.workers.size()) + 1;
+    const int cached = static_cast<int>(max<size_t>(1, bandBytes / max<size_t>(row_bytes, 1)));
+    return max(1, min(cached, (rows + 2 * threads - 1) / (2 * threads)));
+}
+
+inline int band_count(int rows, size_t row_bytes) {
+    const int per_band = band_rows(rows, row_bytes);
+    return (rows + per_band - 1) / per_band;
+}
+
+//Calls fn(band, y0, y1) for every band [y0, y1) of 'rows' rows, spread over the pool
+template <typename F>
+void for_each_band(int rows, size_t row_bytes, F fn) {
+    const int per_band = band_rows(rows, row_bytes);
+    run_tasks(pool, band_count(rows, row_bytes), [&](int band) {
+        fn(band, band * per_band, min(rows, (band + 1) * per_band));
+    });
+}
+
+//Samplers of stb_image_resize2 for one resize geometry, kept so that resizing the same geometry again skips building them
+struct resizer{
+    STBIR_RESIZE resize;
+    bool built = false;
+    int input_w = 0, input_h = 0, output_w = 0, output_h = 0;
+    stbir_pixel_layout layout = STBIR_RGBA;
+    int splits = 0;               //Pieces the samplers were split into, for the threads of the pool
+
+    resizer() = default;
+    resizer(const resizer&) = delete;
+    resizer& operator=(const resizer&) = delete;
+    ~resizer() { if (built) stbir_free_samplers(&resize); }
+};
+
+//Resizes 'input' into 'output' on the thread pool, each thread resizing its own split of the output.
+//Samplers are only rebuilt when the geometry differs from the previous resize with 'r'
+bool resize_image(resizer& r, const unsigned char* input, int input_w, int input_h, unsigned char* output, int output_w, int output_h,
+                  stbir_pixel_layout layout) {
+    if (r.built && r.input_w == input_w && r.input_h == input_h && r.output_w == output_w && r.output_h == output_h && r.layout == layout) {
+        stbir_set_buffer_ptrs(&r.resize, input, 0, output, 0);
+    } else {
+        if (r.built) stbir_free_samplers(&r.resize);
+        stbir_resize_init(&r.resize, input, input_w, input_h, 0, output, output_w, output_h, 0, layout, STBIR_TYPE_UINT8);
+        stbir_set_edgemodes(&r.resize, STBIR_EDGE_CLAMP, STBIR_EDGE_CLAMP);
+        stbir_set_filters(&r.resize, STBIR_FILTER_DEFAULT, STBIR_FILTER_DEFAULT);
+        r.splits = stbir_build_samplers_with_splits(&r.resize, static_cast<int>(pool.workers.size()) + 1);
+        r.built = r.splits > 0;
+        if (!r.built) return false;
+        r.input_w = input_w;
+        r.input_h = input_h;
+        r.output_w = output_w;
+        r.output_h = output_h;
+        r.layout = layout;
+    }
+    atomic<bool> resized{true};
+    run_tasks(pool, r.splits, [&](int split) {
+        if (!stbir_resize_extended_split(&r.resize, split, 1)) resized = false;
+    });
+    return resized;
+}
+
+#ifdef ASCII_LIBJPEG
+//libjpeg reports errors through a callback that must not return; this one jumps back into load_jpeg_scaled
+struct jpeg_error{
+    jpeg_error_mgr mgr;
+    jmp_buf jump;
+};
+
+void jpeg_error_exit(j_common_ptr cinfo) {
+    longjmp(reinterpret_cast<jpeg_error*>(cinfo->err)->jump, 1);
+}
+
+//Decodes an encoded JPEG at the smallest DCT scale of 1/8, 1/4, 1/2 or 1 that still leaves 'min_width' columns; at 1/8
+//only the DC coefficient of every block is decoded. 'desired_channels' is 1 for luminance only, else 0 as in stbi_load.
+//Returns a malloc'ed image that stbi_image_free can release, or null if the bytes are no JPEG libjpeg can decode
+unsigned char* load_jpeg_scaled(const unsigned char* bytes, size_t size, int min_width, int desired_channels,
+                                int* width, int* height, int* channels, int* scale) {
+    if (size < 2 || bytes[0] != 0xFF || bytes[1] != 0xD8) return nullptr; //SOI marker
+
+    jpeg_decompress_struct cinfo;
+    jpeg_error error;
+    unsigned char* volatile pixels = nullptr;
+    cinfo.err = jpeg_std_error(&error.mgr);
+    error.mgr.error_exit = jpeg_error_exit;
+    if (setjmp(error.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        free(pixels);
+        return nullptr;
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, bytes, size);
+    jpeg_read_header(&cinfo, TRUE);
+    if (cinfo.num_components != 1 && cinfo.num_components != 3) longjmp(error.jump, 1); //CMYK and friends go to stb_image
+
+    cinfo.out_color_space = (desired_channels == 1 || cinfo.num_components == 1) ? JCS_GRAYSCALE : JCS_RGB;
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = 8;
+    while (cinfo.scale_denom > 1 && static_cast<int>((cinfo.image_width + cinfo.scale_denom - 1) / cinfo.scale_denom) < min_width)
+        cinfo.scale_denom /= 2;
+    jpeg_start_decompress(&cinfo);
+
+    const size_t row = static_cast<size_t>(cinfo.output_width) * cinfo.output_components;
+    pixels = static_cast<unsigned char*>(malloc(row * cinfo.output_height));
+    if (!pixels) longjmp(error.jump, 1);
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW rows[1] = {pixels + cinfo.output_scanline * row};
+        jpeg_read_scanlines(&cinfo, rows, 1);
+    }
+    *width = cinfo.output_width;
+    *height = cinfo.output_height;
+    *channels = cinfo.output_components;
+    *scale = cinfo.scale_denom;
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return pixels;
+}
+#endif
+
+//An encoded input image. Regular files are mapped read-only and decoded in place; anything that can't be mapped,
+//like a pipe, stays a stream that is decoded as it is read. Bytes already in memory can be wrapped as well
+struct image_input{
+    int fd = -1;
+    const unsigned char* bytes = nullptr; //The whole image, when mapped or wrapped
+    size_t size = 0;
+    bool mapped = false;
+    bool eof = false;                     //The stream has been read to the end
+
+    image_input() = default;
+    image_input(const unsigned char* data, size_t len) : bytes(data), size(len) {}
+    image_input(const image_input&) = delete;
+    image_input& operator=(const image_input&) = delete;
+    ~image_input() {
+        if (mapped) munmap(const_cast<unsigned char*>(bytes), size);
+        if (fd >= 0) close(fd);
+    }
+};
+
+//Opens 'path', or stdin for streamName, as an image_input, mapping it when it is a regular file read from the start
+bool open_input(const string& path, image_input& input) {
+    input.fd = (path == streamName) ? dup(STDIN_FILENO) : open(path.c_str(), O_RDONLY);
+    if (input.fd < 0) return false;
+    struct stat info;
+    if (fstat(input.fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0 && info.st_size <= INT32_MAX &&
+        lseek(input.fd, 0, SEEK_CUR) == 0) {
+        void* mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, input.fd, 0);
+        if (mapped != MAP_FAILED) {
+            madvise(mapped, info.st_size, MADV_SEQUENTIAL); //Decoders read front to back, so read ahead aggressively
+            input.bytes = static_cast<const unsigned char*>(mapped);
+            input.size = info.st_size;
+            input.mapped = true;
+        }
+    }
+    return true;
+}
+
+//stb_image callbacks reading an image_input stream. stb_image takes a short read for the end of the data, so reads
+//continue until 'size' bytes are there or the stream ends
+int input_read(void* user, char* data, int size) {
+    image_input& input = *static_cast<image_input*>(user);
+    int total = 0;
+    while (total < size && !input.eof) {
+        ssize_t n = read(input.fd, data + total, size - total);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) input.eof = true;
+        else total += static_cast<int>(n);
+    }
+    return total;
+}
+
+void input_skip(void* user, int n) {
+    char discard[4096];
+    while (n > 0) {
+        const int got = input_read(user, discard, min(n, static_cast<int>(sizeof(discard))));
+        if (got == 0) return;
+        n -= got;
+    }
+}
+
+int input_eof(void* user) {
+    return static_cast<image_input*>(user)->eof;
+}
+
+//Decodes 'input' like stbi_load does a file
+unsigned char* decode_input(image_input& input, int* width, int* height, int* channels, int desired_channels) {
+    if (input.bytes) return stbi_load_from_memory(input.bytes, static_cast<int>(input.size), width, height, channels, desired_channels);
+    const stbi_io_callbacks callbacks = {input_read, input_skip, input_eof};
+    return stbi_load_from_callbacks(&callbacks, &input, width, height, channels, desired_channels);
+}
+
+//Only the ANSI emitter shows colour; plain text output needs nothing but luminance
+inline bool wants_color(const config& settings) {
+    return settings.terminal;
+}
 
+//Shrinks 'src' into 'dst' by averaging areas: every output pixel is the integer mean of the block of source pixels
+//under it, with block edges rounded to whole pixels. The source rows of a block are streamed once into column sums,
+//which are then reduced to the block's pixels. Output row bands run on the pool. Needs at least one source pixel per
+//output pixel in both directions
+void area_downscale(const unsigned char* src, int width, int height, int channels, unsigned char* dst, int out_w, int out_h) {
+    if (out_w < 1 || out_h < 1) return;
+    const size_t row = static_cast<size_t>(width) * channels;
+    vector<int> column_start(out_w + 1);
+    for (int x = 0; x <= out_w; x++) column_start[x] = static_cast<int>(static_cast<long long>(x) * width / out_w);
+
+    // The source rows of one output row are what a band streams through
+    const size_t block_bytes = row * (height / out_h);
+    vector<unsigned int> sums(row * band_count(out_h, block_bytes));
+    for_each_band(out_h, block_bytes, [&](int band, int y0, int y1) {
+        unsigned int* column_sums = &sums[band * row];
+        for (int y = y0; y < y1; y++) {
+            const int r0 = static_cast<int>(static_cast<long long>(y) * height / out_h);
+            const int r1 = static_cast<int>(static_cast<long long>(y + 1) * height / out_h);
+            fill(column_sums, column_sums + row, 0);
+            for (int r = r0; r < r1; r++) accumulate_row(src + r * row, column_sums, static_cast<int>(row));
+
+            unsigned char* out = dst + static_cast<size_t>(y) * out_w * channels;
+            for (int x = 0; x < out_w; x++) {
+                const int c0 = column_start[x], c1 = column_start[x + 1];
+                const unsigned long long count = static_cast<unsigned long long>(c1 - c0) * (r1 - r0);
+                for (int c = 0; c < channels; c++) {
+                    unsigned long long total = 0; //A block of over 16.8M pixels overflows 32 bits
+                    for (int i = c0; i < c1; i++) total += column_sums[i * channels + c];
+                    *out++ = static_cast<unsigned char>((total + count / 2) / count);
+                }
+            }
+        }
+    });
+}
+
+//Decodes 'input' for 'settings'. Without a colour emitter the image is decoded to a single luminance channel, so
+//decode, resize and mapping only ever touch one plane. Luminance is then taken before the resize rather than after it,
+//with the decoder's weights, so a few cells can map to a neighbouring glyph. Free the pixels with stbi_image_free
+unsigned char* decode_image(const config& settings, image_input& input, int* width, int* height, int* channels) {
+    const int desired_channels = wants_color(settings) ? 0 : 1;
+    unsigned char* pixels = nullptr;
+#ifdef ASCII_LIBJPEG
+    int scale = 1;
+    if (input.bytes) pixels = load_jpeg_scaled(input.bytes, input.size, settings.resX, desired_channels, width, height, channels, &scale);
+    if (pixels && settings.verbose) cout << "JPEG decoded at 1/" << scale << " scale" << '\n';
+#endif
+    if (!pixels) pixels = decode_input(input, width, height, channels, desired_channels);
+    if (desired_channels) *channels = desired_channels;
+    return pixels;
+}
+
+//Rows of the cell grid for 'columns' columns of a 'width' x 'height' image, keeping its aspect ratio
+inline int grid_rows(int columns, int width, int height) {
+    return static_cast<int>(columns * (static_cast<float>(height) / width) * cellAspect);
+}
 
+//Polyphase filtering buys nothing for big reductions, there a plain area average is enough
+inline bool area_resize(int width, int height, int out_w, int out_h) {
+    return out_w > 0 && out_h > 0 && width >= out_w * areaDownscaleRatio && height >= out_h * areaDownscaleRatio;
+}
+
+//Resizes a 'width' x 'height' image with 'channels' channels to the resX x resY cell grid of 'settings' at 'out'
+bool resize_to_grid(const config& settings, const unsigned char* pixels, int width, int height, int channels,
+                    unsigned char* out, resizer& samplers) {
     // Determine the pixel layout based on the number of channels
     stbir_pixel_layout pixel_layout;
     switch (channels) {
@@ -253,19 +963,58 @@ status load_and_process_image(config& settings, unsigned char** data_out) {
         case 2: pixel_layout = STBIR_2CHANNEL; break;
         case 3: pixel_layout = STBIR_RGB; break;
         case 4: pixel_layout = STBIR_RGBA; break;
-        default:
-            cerr << "Unsupported number of channels: " << channels << '\n';
-            free(*data_out);
-            stbi_image_free(data_tmp);
-            return err;
+        default: return false;
+    }
+
+    if (area_resize(width, height, settings.resX, settings.resY)) {
+        area_downscale(pixels, width, height, channels, out, settings.resX, settings.resY);
+        return true;
+    }
+    return resize_image(samplers, pixels, width, height, out, settings.resX, settings.resY, pixel_layout);
+}
+
+//Decodes 'input' and resizes it to the cell grid, see decode_image. 'samplers' keeps the resize samplers for the next
+//call, if given. 'full_image_path' names the input in messages
+status process_input(config& settings, image_input& input, const string& full_image_path, unsigned char** data_out,
+                     mip_pyramid* pyramid = nullptr, resizer* samplers = nullptr) {
+    int width, height, channels;
+
+    // Load image
+    unsigned char* data_tmp = decode_image(settings, input, &width, &height, &channels);
+    if (!data_tmp) {
+        cerr << "Failed to load image: " << full_image_path << '\n';
+        return err;
     }
+    if (settings.verbose) cout << "Image successfully loaded" << '\n';
+
+    // Compute new vertical while maintaining aspect ratio
+    settings.resY = grid_rows(settings.resX, width, height);
+    settings.channels = channels;
+    if (settings.resY < 1) {
+        cerr << "Image is too wide for " << settings.resX << " column(s): " << full_image_path << '\n';
+        stbi_image_free(data_tmp);
+        return err;
+    }
+    *data_out = (unsigned char*)malloc(settings.resX * settings.resY * channels);
 
     // Resize the image
-    stbir_resize(data_tmp, width, height, 0, *data_out, settings.resX, settings.resY, 0,
-                 pixel_layout, STBIR_TYPE_UINT8,
-                 STBIR_EDGE_CLAMP, STBIR_FILTER_DEFAULT);
+    resizer local_samplers;
+    if (!samplers) samplers = &local_samplers;
+    if (!resize_to_grid(settings, data_tmp, width, height, channels, *data_out, *samplers)) {
+        cerr << "Failed to resize image: " << full_image_path << '\n';
+        free(*data_out);
+        stbi_image_free(data_tmp);
+        return err;
+    }
+    if (settings.verbose) {
+        if (area_resize(width, height, settings.resX, settings.resY)) cout << "Image successfully resized by area averaging" << '\n';
+        else cout << "Image successfully resized in " << samplers->splits << " split(s)" << '\n';
+    }
 
-    if (settings.verbose) cout << "Image successfully resized" << '\n';
+    if (pyramid && settings.antialias && settings.rotateSpeed > 0) {
+        build_mip_pyramid(data_tmp, width, height, channels, settings.resX, settings.resY, *pyramid);
+        if (settings.verbose) cout << "Sampling rotations from mip level " << pyramid->level_index << '\n';
+    }
 
     // Free original image data
     stbi_image_free(data_tmp);
@@ -273,94 +1022,736 @@ status load_and_process_image(config& settings, unsigned char** data_out) {
     return def;
 }
 
-status produce_ascii(config settings, unsigned char* data) {
-    static vector<string> previous_buffer; // Persistent buffer for the last ASCII art
-    ostringstream buffer;
-    vector<string> current_buffer; // Buffer for the current ASCII art
-
-    for (int i = 0; i < settings.resY; i++) {
-        string linebuff = "";
-        for (int j = 0; j < settings.resX; j++) {
-            int pixel_index = (i * settings.resX + j) * settings.channels;
-
-            // Extract color components
-            unsigned char r = 0, g = 0, b = 0;
-            if (settings.channels == 1) {
-                r = g = b = data[pixel_index];
-            } else if (settings.channels >= 3) {
-                r = data[pixel_index];
-                g = data[pixel_index + 1];
-                b = data[pixel_index + 2];
-            } else {
-                cerr << "Unsupported number of channels: " << settings.channels << '\n';
-                free(data);
-                return err;
+//Loads the image file of 'settings' and resizes it to the cell grid, see process_input
+status load_and_process_image(config& settings, unsigned char** data_out, mip_pyramid* pyramid = nullptr, resizer* samplers = nullptr) {
+    string full_image_path = (settings.filename == streamName) ? streamName : get_full_image_path(settings.filename);
+    image_input input;
+    if (!open_input(full_image_path, input)) {
+        cerr << "Failed to load image: " << full_image_path << '\n';
+        return err;
+    }
+    return process_input(settings, input, full_image_path, data_out, pyramid, samplers);
+}
+
+//Decimal text of every byte value, so that colour escapes never go through to_string
+struct decimal_table{
+    char text[256][4];
+    unsigned char len[256];
+
+    decimal_table() {
+        for (int v = 0; v < 256; v++) len[v] = static_cast<unsigned char>(snprintf(text[v], sizeof(text[v]), "%d", v));
+    }
+};
+const decimal_table decimals;
+
+const unsigned int noColor = 0xFFFFFFFF; //Never equal to a packed 24 bit colour
+
+//Terminal output statistics, accumulated over all frames
+struct emit_stats{
+    long frames = 0;
+    long bytes = 0;          //Bytes written to the terminal
+    long lastBytes = 0;      //Bytes written for the most recent frame
+    long minBytes = 0;
+    long maxBytes = 0;
+    long toleranceSaved = 0; //Escape bytes not written because of --color-tolerance
+};
+
+//Squared "redmean" distance between two packed colours, times 256. A cheap integer approximation of perceptual difference
+inline int color_distance2(unsigned int a, unsigned int b) {
+    const int rmean = static_cast<int>(((a >> 16) + (b >> 16)) >> 1);
+    const int dr = static_cast<int>(a >> 16) - static_cast<int>(b >> 16);
+    const int dg = static_cast<int>((a >> 8) & 0xFF) - static_cast<int>((b >> 8) & 0xFF);
+    const int db = static_cast<int>(a & 0xFF) - static_cast<int>(b & 0xFF);
+    return (512 + rmean) * dr * dr + 1024 * dg * dg + (767 - rmean) * db * db;
+}
+
+//Length of the SGR sequence put_sgr writes for a colour
+inline int sgr_length(unsigned char r, unsigned char g, unsigned char b) {
+    return 7 + decimals.len[r] + 1 + decimals.len[g] + 1 + decimals.len[b] + 1;
+}
+
+//Longest escape any colour mode writes in front of a character: "ESC[38;2;255;255;255m"
+const size_t maxSgrBytes = 19;
+
+//Longest cursor move "ESC[row;colH"
+const size_t maxCursorBytes = 2 + 10 + 1 + 10 + 1;
+
+//The put_* functions write at 'out' and return the new end. Callers size the buffer for the worst case up front
+
+inline char* put(char* out, const char* text, size_t len) {
+    memcpy(out, text, len);
+    return out + len;
+}
+
+//Always copies 4 bytes, which is fine since room for 3 digits is reserved either way
+inline char* put_byte(char* out, unsigned char v) {
+    memcpy(out, decimals.text[v], 4);
+    return out + decimals.len[v];
+}
+
+inline char* put_uint(char* out, unsigned int v) {
+    char digits[10];
+    int n = 0;
+    do { digits[n++] = static_cast<char>('0' + v % 10); v /= 10; } while (v);
+    while (n) *out++ = digits[--n];
+    return out;
+}
+
+//Writes the truecolor SGR sequence "ESC[38;2;R;G;Bm"
+inline char* put_sgr(char* out, unsigned char r, unsigned char g, unsigned char b) {
+    out = put(out, "\033[38;2;", 7);
+    out = put_byte(out, r);
+    *out++ = ';';
+    out = put_byte(out, g);
+    *out++ = ';';
+    out = put_byte(out, b);
+    *out++ = 'm';
+    return out;
+}
+
+//RGB -> terminal palette index, quantized to 5 bits per channel so that a lookup replaces the nearest-colour search
+struct color_cube{
+    unsigned char index[32 * 32 * 32];
+};
+
+inline int cube_slot(unsigned int color) {
+    return ((color >> 9) & 0x7C00) | ((color >> 6) & 0x03E0) | ((color >> 3) & 0x001F);
+}
+
+//xterm's default RGB values for the 16 basic colours
+const unsigned int basicColors[16] = {
+    0x000000, 0xCD0000, 0x00CD00, 0xCDCD00, 0x0000EE, 0xCD00CD, 0x00CDCD, 0xE5E5E5,
+    0x7F7F7F, 0xFF0000, 0x00FF00, 0xFFFF00, 0x5C5CFF, 0xFF00FF, 0x00FFFF, 0xFFFFFF,
+};
+
+//RGB value of an xterm-256 colour. Only the 6x6x6 cube and gray ramp (16-255) are used, since 0-15 vary between terminals
+unsigned int xterm256_color(int index) {
+    if (index >= 232) { unsigned int v = 8 + 10 * (index - 232); return (v << 16) | (v << 8) | v; }
+    const unsigned int levels[6] = {0, 95, 135, 175, 215, 255};
+    index -= 16;
+    return (levels[index / 36] << 16) | (levels[index / 6 % 6] << 8) | levels[index % 6];
+}
+
+//Builds the lookup cube for 'mode' by searching the nearest palette colour for the centre of every slot. Unused for truecolor
+color_cube compile_color_cube(color_mode mode) {
+    color_cube cube;
+    if (mode == truecolor) return cube;
+
+    vector<pair<unsigned int, int> > candidates;
+    if (mode == ansi16) for (int i = 0; i < 16; i++) candidates.push_back(make_pair(basicColors[i], i));
+    else for (int i = 16; i < 256; i++) candidates.push_back(make_pair(xterm256_color(i), i));
+
+    for (int slot = 0; slot < 32 * 32 * 32; slot++) {
+        const unsigned int center = (((slot >> 10) * 8 + 4) << 16) | ((((slot >> 5) & 31) * 8 + 4) << 8) | ((slot & 31) * 8 + 4);
+        int best = 0;
+        int best_distance = color_distance2(center, candidates[0].first);
+        for (size_t c = 1; c < candidates.size(); c++) {
+            int distance = color_distance2(center, candidates[c].first);
+            if (distance < best_distance) { best_distance = distance; best = static_cast<int>(c); }
+        }
+        cube.index[slot] = static_cast<unsigned char>(candidates[best].second);
+    }
+    return cube;
+}
+
+//Writes the escape selecting palette colour 'index' in a 16 or 256 colour mode
+inline char* put_indexed_sgr(char* out, color_mode mode, unsigned char index) {
+    if (mode == ansi16) {
+        out = put(out, index < 8 ? "\033[3" : "\033[9", 3);
+        *out++ = static_cast<char>('0' + (index & 7));
+    } else {
+        out = put(out, "\033[38;5;", 7);
+        out = put_byte(out, index);
+    }
+    *out++ = 'm';
+    return out;
+}
+
+//Output of the render pipeline, see glyphsmith.h
+typedef glyphsmith::CellGrid cell_grid;
+
+//Buffers that live across frames, so that a frame in steady state is produced without allocating
+struct frame_buffers{
+    cell_grid grid;                //Current frame
+    cell_grid previous;            //Last frame sent to the terminal
+    bool has_previous = false;
+    vector<char> out;              //Bytes of one write() to the terminal or output file
+    size_t terminal_bytes = 0;     //How much of 'out' the last terminal frame took
+    vector<char> line;             //Scratch for the whole-line alternative of a damaged line, one per emit band
+    vector<unsigned char> gray;    //Scratch row for map_row, one per render band
+    vector<char*> band_ends;       //Where the bytes of each emit band end
+    vector<emit_stats> band_stats;
+};
+
+//Most bytes a row of 'width' cells can take in a damaged frame: an escape before every character, and as damage
+//spans are at least a cursor move apart, no more than one cursor move per two cells
+inline size_t max_line_bytes(int width) {
+    return width * (maxSgrBytes + 1) + (width / 2 + 1) * maxCursorBytes;
+}
+
+//Bytes of one row of a cell_grid, for banding the emit stage
+inline size_t grid_row_bytes(int width) {
+    return width * (sizeof(char) + sizeof(unsigned int));
+}
+
+//Most bytes emit_ansi writes for a 'width' x 'height' grid: clear + home, then per line its worst case, a reset and
+//a newline, then the final reset
+inline size_t max_frame_bytes(int width, int height) {
+    return 7 + height * (max_line_bytes(width) + 5) + 5;
+}
+
+//Sizes the per-band scratch of 'buffers' for rendering and emitting a 'width' x 'height' grid of 'channels' pixels.
+//Only allocates when it grows
+void prepare_scratch(int width, int height, int channels, frame_buffers& buffers) {
+    const int emit_bands = band_count(height, grid_row_bytes(width));
+    const size_t line_bytes = max_line_bytes(width) * emit_bands;
+    if (buffers.line.size() < line_bytes) buffers.line.resize(line_bytes);
+    if (buffers.band_ends.size() < static_cast<size_t>(emit_bands)) buffers.band_ends.resize(emit_bands);
+    if (buffers.band_stats.size() < static_cast<size_t>(emit_bands)) buffers.band_stats.resize(emit_bands);
+    const size_t gray_bytes = static_cast<size_t>(width) * band_count(height, static_cast<size_t>(width) * channels);
+    if (buffers.gray.size() < gray_bytes) buffers.gray.resize(gray_bytes);
+}
+
+//Sizes 'buffers' for the worst case frame. Only allocates on the first frame or when the geometry changes
+void prepare_frame_buffers(const config& settings, frame_buffers& buffers) {
+    prepare_scratch(settings.resX, settings.resY, settings.channels, buffers);
+    if (buffers.grid.width == settings.resX && buffers.grid.height == settings.resY) return;
+    buffers.grid.resize(settings.resX, settings.resY);
+    buffers.previous.resize(settings.resX, settings.resY);
+    buffers.has_previous = false;
+    buffers.out.resize(max_frame_bytes(settings.resX, settings.resY));
+}
+
+//Writes all 'len' bytes to 'fd', continuing after partial writes
+bool write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += written;
+        len -= written;
+    }
+    return true;
+}
+
+//Samples an image with C interleaved channels (1 gray, 2 gray+alpha, 3 RGB, 4 RGBA) into 'grid'. Alpha is ignored
+//Instantiated once per channel count so the loops carry no layout branches
+//Row bands are rendered in parallel, each with its own scratch row in 'gray'. The colour plane is left alone when
+//no emitter shows colour
+template <int C>
+void render_grid(const config& settings, const palette& pal, const unsigned char* data, vector<unsigned char>& gray, cell_grid& grid) {
+    const bool color = wants_color(settings);
+    for_each_band(settings.resY, static_cast<size_t>(settings.resX) * C, [&](int band, int y0, int y1) {
+        unsigned char* band_gray = &gray[static_cast<size_t>(band) * settings.resX];
+        for (int i = y0; i < y1; i++) {
+            const unsigned char* row = data + i * settings.resX * C;
+            char* glyphs = &grid.glyphs[static_cast<size_t>(i) * settings.resX];
+            unsigned int* colors = &grid.colors[static_cast<size_t>(i) * settings.resX];
+            map_row(pal, row, band_gray, glyphs, settings.resX, C);
+            if (!color) continue;
+            for (int j = 0; j < settings.resX; j++, row += C) {
+                if (C >= 3) colors[j] = (row[0] << 16) | (row[1] << 8) | row[2];
+                else colors[j] = row[0] * 0x010101u;
             }
+        }
+    });
+}
 
-            // Compute grayscale value
-            unsigned char grayscale_value = static_cast<unsigned char>(
-                0.299f * r + 0.587f * g + 0.114f * b
-            );
+//Plain text emitter: the glyphs, one line per row
+char* emit_plain(const cell_grid& grid, char* out) {
+    for (int i = 0; i < grid.height; i++) {
+        out = put(out, &grid.glyphs[static_cast<size_t>(i) * grid.width], grid.width);
+        *out++ = '\n';
+    }
+    return out;
+}
+
+inline int decimal_digits(unsigned int v) {
+    int n = 1;
+    while (v >= 10) { v /= 10; n++; }
+    return n;
+}
 
-            // Map grayscale value to ASCII character
-            char ascii_char = ascii_chars[grayscale_value * ascii_chars.size() / 256];
+//Writes the cursor move to 1-based 'row' and 'col'
+inline char* put_cursor(char* out, int row, int col) {
+    out = put(out, "\033[", 2);
+    out = put_uint(out, row);
+    *out++ = ';';
+    out = put_uint(out, col);
+    *out++ = 'H';
+    return out;
+}
+
+inline int cursor_bytes(int row, int col) {
+    return 4 + decimal_digits(row) + decimal_digits(col);
+}
 
-            // Add to the line buffer
-            if (settings.terminal)
-                linebuff += "\033[38;2;" + to_string((int)r) + ";" +
-                            to_string((int)g) + ";" +
-                            to_string((int)b) + "m" +
-                            ascii_char;
+//ANSI emitter for cells [x0, x1) of row 'y'. 'active' is the colour the terminal currently has and is kept up to date.
+//A colour is only emitted when it differs from the active one by more than --color-tolerance;
+//spaces show no colour and never change it. In 16 and 256 colour modes colours are compared after quantization
+char* emit_ansi_cells(const config& settings, const color_cube& cube, const cell_grid& grid, int y, int x0, int x1,
+                      char* out, unsigned int& active, emit_stats& stats) {
+    const char* glyphs = &grid.glyphs[static_cast<size_t>(y) * grid.width];
+    const unsigned int* colors = &grid.colors[static_cast<size_t>(y) * grid.width];
+
+    if (settings.colors != truecolor) {
+        for (int j = x0; j < x1; j++) {
+            const unsigned char index = cube.index[cube_slot(colors[j])];
+            if (index != active && glyphs[j] != ' ') {
+                out = put_indexed_sgr(out, settings.colors, index);
+                active = index;
+            }
+            *out++ = glyphs[j];
         }
-        if (settings.terminal) buffer << linebuff << "\033[0m" << '\n';
-        current_buffer.push_back(linebuff);
+        return out;
     }
 
-    if (settings.terminal) {
-        if (previous_buffer.empty()) {
-            // First run: Print the whole ASCII art
-            cout << "\033[2J\033[H" << buffer.str();
-        } else {
-            // Compare with previous buffer and only update differences
-            for (size_t i = 0; i < current_buffer.size(); i++) {
-                if (current_buffer[i] != previous_buffer[i] || i >= previous_buffer.size()) {
-                    // Move the cursor to the correct line
-                    cout << "\033[" << (i + 1) << ";1H" << current_buffer[i];
-                }
+    const int threshold = settings.colorTolerance * settings.colorTolerance * 256;
+    for (int j = x0; j < x1; j++) {
+        const unsigned int color = colors[j];
+        if (color != active && glyphs[j] != ' ') {
+            const unsigned char r = color >> 16, g = (color >> 8) & 0xFF, b = color & 0xFF;
+            if (active != noColor && color_distance2(color, active) <= threshold) {
+                stats.toleranceSaved += sgr_length(r, g, b);
+            } else {
+                out = put_sgr(out, r, g, b);
+                active = color;
             }
         }
-        // Reset cursor at the end of the drawing
-        cout << "\033[0m" << '\n';
+        *out++ = glyphs[j];
     }
+    return out;
+}
 
-    if (settings.output) {
-        ofstream outFile(settings.output_file);
-        if (!outFile.is_open()) {
-            cerr << "Failed to open output file: " << settings.output_file << '\n';
-            free(data);
-            return err;
+//A cell is damaged if its glyph changed, or its colour changed and the glyph shows colour at all
+inline bool cell_damaged(const cell_grid& grid, const cell_grid& previous, size_t i) {
+    return grid.glyphs[i] != previous.glyphs[i] || (grid.glyphs[i] != ' ' && grid.colors[i] != previous.colors[i]);
+}
+
+//Redraws the damaged cells of row 'y'. Damaged cells are grouped into spans, merging spans separated by no more
+//undamaged cells than the cursor move to the span takes bytes. That is a heuristic: it counts a gap cell as one byte,
+//though one that needs a colour escape costs up to maxSgrBytes more. Each span is sent after a cursor move, unless
+//rewriting the whole line is shorter, which is measured exactly
+char* emit_ansi_damage(const config& settings, const color_cube& cube, const cell_grid& grid, const cell_grid& previous, int y,
+                       char* out, char* scratch, unsigned int& active, emit_stats& stats) {
+    const size_t row = static_cast<size_t>(y) * grid.width;
+    int x = 0;
+    while (x < grid.width && !cell_damaged(grid, previous, row + x)) x++;
+    if (x == grid.width) return out;
+
+    //Damaged spans, each sent after a cursor move
+    char* spans_start = out;
+    unsigned int spans_active = active;
+    emit_stats spans_stats;
+    while (x < grid.width) {
+        const int start = x;
+        const int merge_gap = cursor_bytes(y + 1, start + 1); //In cells, see above
+        int end = x + 1;
+        for (int gap = 0; x < grid.width && gap <= merge_gap; x++) {
+            if (cell_damaged(grid, previous, row + x)) { end = x + 1; gap = 0; }
+            else gap++;
         }
-        for (const auto& line : current_buffer) {
-            outFile << line << '\n';
+        out = put_cursor(out, y + 1, start + 1);
+        out = emit_ansi_cells(settings, cube, grid, y, start, end, out, spans_active, spans_stats);
+        x = end;
+        while (x < grid.width && !cell_damaged(grid, previous, row + x)) x++;
+    }
+
+    //The whole line, for comparison
+    unsigned int line_active = active;
+    emit_stats line_stats;
+    char* line_end = put_cursor(scratch, y + 1, 1);
+    line_end = emit_ansi_cells(settings, cube, grid, y, 0, grid.width, line_end, line_active, line_stats);
+
+    if (line_end - scratch < out - spans_start) {
+        active = line_active;
+        stats.toleranceSaved += line_stats.toleranceSaved;
+        return put(spans_start, scratch, line_end - scratch);
+    }
+    active = spans_active;
+    stats.toleranceSaved += spans_stats.toleranceSaved;
+    return out;
+}
+
+//ANSI emitter for a whole frame. Only damaged cells are redrawn, unless 'previous' is null.
+//Row bands are encoded in parallel, each into the worst-case share of 'out' of its rows with its own scratch line
+//from 'buffers', and are then joined in order. Every band starts out without an active colour
+char* emit_ansi(const config& settings, const color_cube& cube, const cell_grid& grid, const cell_grid* previous,
+                char* out, frame_buffers& buffers, emit_stats& stats) {
+    // First run: clear the screen and print the whole ASCII art
+    if (!previous) out = put(out, "\033[2J\033[H", 7);
+
+    const size_t line_bytes = max_line_bytes(grid.width);
+    for_each_band(grid.height, grid_row_bytes(grid.width), [&](int band, int y0, int y1) {
+        char* band_out = out + y0 * (line_bytes + 5);
+        char* scratch = &buffers.line[band * line_bytes];
+        emit_stats& band_stats = buffers.band_stats[band];
+        band_stats = emit_stats();
+        unsigned int active = noColor; //Colours survive cursor moves, so the active one carries across lines
+        for (int i = y0; i < y1; i++) {
+            if (!previous) {
+                active = noColor;
+                band_out = emit_ansi_cells(settings, cube, grid, i, 0, grid.width, band_out, active, band_stats);
+                band_out = put(band_out, "\033[0m\n", 5);
+            } else if (!grid.same_row(*previous, i)) {
+                band_out = emit_ansi_damage(settings, cube, grid, *previous, i, band_out, scratch, active, band_stats);
+            }
         }
-        outFile.close();
+        buffers.band_ends[band] = band_out;
+    });
+
+    // Join the bands. The first one is already in place
+    const int per_band = band_rows(grid.height, grid_row_bytes(grid.width));
+    char* joined = out;
+    for (int band = 0; band * per_band < grid.height; band++) {
+        const char* start = out + band * per_band * (line_bytes + 5);
+        const size_t len = buffers.band_ends[band] - start;
+        memmove(joined, start, len);
+        joined += len;
+        stats.toleranceSaved += buffers.band_stats[band].toleranceSaved;
     }
+    // Reset colour at the end of the drawing
+    return put(joined, "\033[0m\n", 5);
+}
 
-    if (settings.verbose && settings.output) {
-        cout << "ASCII art saved to '" << settings.output_file << "'!" << '\n';
+//Writes an encoded terminal frame and records it in 'stats'
+status write_terminal(const char* bytes, size_t len, emit_stats& stats) {
+    cout.flush();
+    if (!write_all(STDOUT_FILENO, bytes, len)) {
+        cerr << "Failed to write to terminal" << '\n';
+        return err;
     }
+    const long n = static_cast<long>(len);
+    stats.minBytes = (stats.frames == 0) ? n : min(stats.minBytes, n);
+    stats.maxBytes = max(stats.maxBytes, n);
+    stats.lastBytes = n;
+    stats.frames++;
+    stats.bytes += n;
+    return def;
+}
 
-    // Update the previous buffer
-    previous_buffer = current_buffer;
+//Renders 'data' into 'grid', picking the pixel layout once for the whole frame. False for an unsupported layout
+bool render_cells(const config& settings, const palette& pal, const unsigned char* data, vector<unsigned char>& gray, cell_grid& grid) {
+    switch (settings.channels) {
+        case 1: render_grid<1>(settings, pal, data, gray, grid); return true;
+        case 2: render_grid<2>(settings, pal, data, gray, grid); return true;
+        case 3: render_grid<3>(settings, pal, data, gray, grid); return true;
+        case 4: render_grid<4>(settings, pal, data, gray, grid); return true;
+        default: return false;
+    }
+}
 
+//Renders 'data' into the cell grid of 'buffers'
+status render_frame(const config& settings, const palette& pal, const unsigned char* data, frame_buffers& buffers) {
+    prepare_frame_buffers(settings, buffers);
+    if (!render_cells(settings, pal, data, buffers.gray, buffers.grid)) {
+        cerr << "Unsupported number of channels: " << settings.channels << '\n';
+        return err;
+    }
     return def;
 }
 
-unsigned char* rotate_image(const unsigned char* img, int width, int height, int channels, double theta) {
-    int new_width = width;
-    int new_height = height;
-    unsigned char* rotated_img = (unsigned char*)malloc(new_width * new_height * channels);
-    
+//Encodes the cell grid of 'buffers' at 'out' as terminal bytes that update the screen from the previous frame,
+//which the grid then replaces. Returns the end of the encoded bytes
+char* encode_terminal(const config& settings, const color_cube& cube, frame_buffers& buffers, char* out, emit_stats& stats) {
+    char* end = emit_ansi(settings, cube, buffers.grid, buffers.has_previous ? &buffers.previous : nullptr,
+                          out, buffers, stats);
+    // The current frame becomes the previous one
+    swap(buffers.grid, buffers.previous);
+    buffers.has_previous = true;
+    return end;
+}
+
+//Writes 'grid' as plain text to the output file, or stdout for streamName, with a single write(), using 'scratch' for the bytes
+status write_output(const config& settings, const cell_grid& grid, char* scratch) {
+    char* end = emit_plain(grid, scratch);
+    if (settings.output_file == streamName) {
+        if (write_all(STDOUT_FILENO, scratch, end - scratch)) return def;
+        cerr << "Failed to write output to stdout" << '\n';
+        return err;
+    }
+    int fd = open(settings.output_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        cerr << "Failed to open output file: " << settings.output_file << '\n';
+        return err;
+    }
+    bool written = write_all(fd, scratch, end - scratch);
+    close(fd);
+    if (!written) {
+        cerr << "Failed to write output file: " << settings.output_file << '\n';
+        return err;
+    }
+    return def;
+}
+
+//Emits the cell grid of 'buffers' to the terminal and/or output file, each with a single write()
+status emit_frame(const config& settings, const color_cube& cube, frame_buffers& buffers, emit_stats& stats) {
+    if (settings.terminal) {
+        char* end = encode_terminal(settings, cube, buffers, buffers.out.data(), stats);
+        buffers.terminal_bytes = end - buffers.out.data();
+        if (write_terminal(buffers.out.data(), buffers.terminal_bytes, stats) != def) return err;
+    }
+
+    if (settings.output && write_output(settings, settings.terminal ? buffers.previous : buffers.grid, buffers.out.data()) != def) return err;
+
+    if (settings.verbose && settings.output) {
+        if (settings.output_file == streamName) cout << "ASCII art written to stdout" << '\n';
+        else cout << "ASCII art saved to '" << settings.output_file << "'!" << '\n';
+    }
+
+    return def;
+}
+
+//Renders 'data' and emits it
+status produce_ascii(const config& settings, const palette& pal, const color_cube& cube, const unsigned char* data, frame_buffers& buffers, emit_stats& stats) {
+    status stat = render_frame(settings, pal, data, buffers);
+    if (stat != def) return stat;
+    return emit_frame(settings, cube, buffers, stats);
+}
+
+//libglyphsmith, see glyphsmith.h. A Renderer is the state one worker of --batch or --serve keeps across images.
+//The pool is never started by the library, so every stage runs inline on the calling thread
+struct glyphsmith::Renderer::state{
+    config settings;
+    palette pal;
+    color_cube cube;
+    frame_buffers buffers;          //Only the per-band scratch is used; grids belong to the caller
+    resizer samplers;
+    vector<unsigned char> resized;  //The image at cell grid size
+    emit_stats stats;
+};
+
+glyphsmith::Renderer::Renderer(const Options& options) : impl(new state) {
+    config& settings = impl->settings;
+    settings.resX = options.width;
+    settings.invert = options.invert;
+    settings.terminal = options.colors != ColorMode::none;
+    settings.output = false;
+    settings.colorTolerance = min(max(options.color_tolerance, 0), maxColorTolerance);
+    switch (options.colors) {
+        case ColorMode::ansi16: settings.colors = ansi16; break;
+        case ColorMode::ansi256: settings.colors = ansi256; break;
+        default: settings.colors = truecolor; break;
+    }
+
+    string chars = options.glyphs;
+    if (chars.empty()) {
+        const vector<pair<char, int> > coverage(begin(builtinCoverage), end(builtinCoverage));
+        chars = pick_chars(coverage, min(max(options.glyph_count, 2), maxGlyphs));
+    }
+    if (settings.invert) reverse(chars.begin(), chars.end());
+    impl->pal = compile_palette(chars);
+    impl->cube = compile_color_cube(settings.colors);
+}
+
+glyphsmith::Renderer::~Renderer() = default;
+
+bool glyphsmith::Renderer::render(const Image& image, CellGrid& grid) {
+    if (!image.pixels || image.width <= 0 || image.height <= 0) return false;
+    config& settings = impl->settings;
+    settings.resY = grid_rows(settings.resX, image.width, image.height);
+    settings.channels = image.channels;
+    if (settings.resX <= 0 || settings.resY <= 0) return false;
+
+    impl->resized.resize(static_cast<size_t>(settings.resX) * settings.resY * settings.channels);
+    if (!resize_to_grid(settings, image.pixels, image.width, image.height, image.channels, impl->resized.data(), impl->samplers))
+        return false;
+    prepare_scratch(settings.resX, settings.resY, settings.channels, impl->buffers);
+    grid.resize(settings.resX, settings.resY);
+    return render_cells(settings, impl->pal, impl->resized.data(), impl->buffers.gray, grid);
+}
+
+bool glyphsmith::Renderer::render_encoded(const unsigned char* bytes, size_t size, CellGrid& grid) {
+    if (!bytes || size == 0 || size > INT32_MAX) return false;
+    image_input input(bytes, size);
+    Image image;
+    unsigned char* pixels = decode_image(impl->settings, input, &image.width, &image.height, &image.channels);
+    if (!pixels) return false;
+    image.pixels = pixels;
+    const bool rendered = render(image, grid);
+    stbi_image_free(pixels);
+    return rendered;
+}
+
+size_t glyphsmith::Renderer::plain_capacity(int width, int height) {
+    return static_cast<size_t>(width + 1) * height;
+}
+
+size_t glyphsmith::Renderer::ansi_capacity(int width, int height) {
+    return max_frame_bytes(width, height);
+}
+
+size_t glyphsmith::Renderer::emit_plain(const CellGrid& grid, char* out) const {
+    return ::emit_plain(grid, out) - out;
+}
+
+size_t glyphsmith::Renderer::emit_ansi(const CellGrid& grid, const CellGrid* previous, char* out) {
+    // Without colours the grid has no colour plane to draw from, so the whole frame is redrawn as plain glyphs
+    if (!impl->settings.terminal) {
+        char* end = previous ? put(out, "\033[H", 3) : put(out, "\033[2J\033[H", 7);
+        return ::emit_plain(grid, end) - out;
+    }
+    prepare_scratch(grid.width, grid.height, 1, impl->buffers);
+    return ::emit_ansi(impl->settings, impl->cube, grid, previous, out, impl->buffers, impl->stats) - out;
+}
+
+//One frame of a revolution: its cell grid and, once known, the terminal bytes that update the screen from the frame
+//before it. Revolutions repeat exactly because every frame index maps to the same angle
+struct cached_frame{
+    cell_grid grid;
+    bool has_grid = false;
+    vector<char> encoded;
+    bool has_encoded = false;
+};
+
+//Frames of one revolution, filled on the first pass and replayed on later ones within --cache-mb
+struct frame_cache{
+    vector<cached_frame> frames;
+    size_t bytes = 0;
+    size_t budget = 0;
+};
+
+//Reserves a slot per frame of a revolution, unless even the grids would exceed --cache-mb. Returns whether caching is on
+bool init_frame_cache(const config& settings, int frames_per_revolution, frame_cache& cache) {
+    const size_t grid_bytes = static_cast<size_t>(settings.resX) * settings.resY * (sizeof(char) + sizeof(unsigned int));
+    cache.budget = static_cast<size_t>(settings.cacheMB) * 1024 * 1024;
+    if (settings.rotations == 1 || grid_bytes * frames_per_revolution > cache.budget) return false;
+    cache.frames.resize(frames_per_revolution);
+    cache.bytes = grid_bytes * frames_per_revolution;
+    return true;
+}
+
+//Keeps the terminal bytes just encoded for 'frame', if they fit in the budget. Once kept they are never modified
+void cache_encoded(const char* bytes, size_t len, frame_cache& cache, cached_frame& frame) {
+    if (frame.has_encoded || cache.bytes + len > cache.budget) return;
+    frame.encoded.assign(bytes, bytes + len);
+    frame.has_encoded = true;
+    cache.bytes += len;
+}
+
+//Makes 'frame' the previous frame of 'buffers', as if it had just been encoded. Its cached bytes are then replayed
+//instead; only valid when the screen shows the frame they were encoded against
+void replay_frame(const config& settings, const cached_frame& frame, frame_buffers& buffers) {
+    prepare_frame_buffers(settings, buffers);
+    buffers.previous.glyphs = frame.grid.glyphs;
+    buffers.previous.colors = frame.grid.colors;
+    buffers.has_previous = true;
+}
+
+//Prints the terminal output statistics gathered by produce_ascii
+void print_emit_stats(const config& settings, const emit_stats& stats) {
+    if (stats.frames == 0) return;
+    cout << "Terminal output: " << stats.bytes / stats.frames << " bytes per frame (min " << stats.minBytes << ", max " << stats.maxBytes
+         << ", last " << stats.lastBytes << ")";
+    if (settings.colorTolerance > 0)
+        cout << ", colour tolerance " << settings.colorTolerance << " saved " << stats.toleranceSaved / stats.frames << " bytes per frame ("
+             << 100.0 * stats.toleranceSaved / (stats.bytes + stats.toleranceSaved) << "%)";
+    cout << '\n';
+}
+
+//Copies 'count' pixels of a rotated row. The 16.16 fixed-point source position starts at (sx, sy) and steps by
+//(dx, dy) per pixel; every position is known to be inside the source, so there are no bounds checks
+template <int C>
+void rotate_span(const unsigned char* img, int width, int height, unsigned char* out, int count, int sx, int sy, int dx, int dy) {
+    (void)height;
+    for (int i = 0; i < count; i++, out += C, sx += dx, sy += dy)
+        memcpy(out, img + ((sy >> 16) * width + (sx >> 16)) * C, C);
+}
+
+typedef void (*rotate_span_fn)(const unsigned char* img, int width, int height, unsigned char* out, int count, int sx, int sy, int dx, int dy);
+
+#ifdef ASCII_X86
+//Spans with 8 pixel gathers. Every pixel is fetched as a 32 bit load, so for fewer than 4 channels a batch that would
+//read past the end of the image goes through the scalar path, and batches are packed down to C bytes per pixel with
+//16 byte stores whose spill is overwritten by the next batch or the scalar tail
+template <int C>
+__attribute__((target("avx2"))) void rotate_span_avx2(const unsigned char* img, int width, int height, unsigned char* out, int count, int sx, int sy, int dx, int dy) {
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i stride = _mm256_set1_epi32(width * C);
+    const __m256i step_x = _mm256_set1_epi32(dx * 8), step_y = _mm256_set1_epi32(dy * 8);
+    const __m256i last_safe = _mm256_set1_epi32(width * height * C - 4); //Last byte offset a 32 bit load may start at
+    const __m256i pack = (C == 3) ? _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                                     0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1)
+                       : (C == 2) ? _mm256_setr_epi8(0, 1, 4, 5, 8, 9, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1,
+                                                     0, 1, 4, 5, 8, 9, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1)
+                                  : _mm256_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                                     0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    __m256i vx = _mm256_add_epi32(_mm256_set1_epi32(sx), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(dx)));
+    __m256i vy = _mm256_add_epi32(_mm256_set1_epi32(sy), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(dy)));
+    int i = 0;
+    for (; (C == 4) ? (i + 8 <= count) : ((i + 4) * C + 16 <= count * C); i += 8) {
+        __m256i offset = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_srai_epi32(vy, 16), stride),
+                                          _mm256_mullo_epi32(_mm256_srai_epi32(vx, 16), _mm256_set1_epi32(C)));
+        vx = _mm256_add_epi32(vx, step_x);
+        vy = _mm256_add_epi32(vy, step_y);
+        if (C == 4) {
+            _mm256_storeu_si256((__m256i*)(out + i * 4), _mm256_i32gather_epi32((const int*)img, offset, 1));
+            continue;
+        }
+        if (_mm256_movemask_epi8(_mm256_cmpgt_epi32(offset, last_safe))) {
+            rotate_span<C>(img, width, height, out + i * C, 8, sx + i * dx, sy + i * dy, dx, dy);
+            continue;
+        }
+        __m256i px = _mm256_shuffle_epi8(_mm256_i32gather_epi32((const int*)img, offset, 1), pack);
+        _mm_storeu_si128((__m128i*)(out + i * C), _mm256_castsi256_si128(px));
+        _mm_storeu_si128((__m128i*)(out + (i + 4) * C), _mm256_extracti128_si256(px, 1));
+    }
+    rotate_span<C>(img, width, height, out + i * C, count - i, sx + i * dx, sy + i * dy, dx, dy);
+}
+#endif
+
+//Span copiers for 1 to 4 channels, picked once for this CPU
+struct rotate_kernels{
+    rotate_span_fn span[5];
+
+    rotate_kernels() {
+        span[0] = nullptr;
+        span[1] = rotate_span<1>;
+        span[2] = rotate_span<2>;
+        span[3] = rotate_span<3>;
+        span[4] = rotate_span<4>;
+#ifdef ASCII_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            span[1] = rotate_span_avx2<1>;
+            span[2] = rotate_span_avx2<2>;
+            span[3] = rotate_span_avx2<3>;
+            span[4] = rotate_span_avx2<4>;
+        }
+#endif
+    }
+};
+const rotate_kernels rotate_spans;
+
+inline long long floor_div(long long a, long long b) {
+    long long q = a / b;
+    return (a % b != 0 && ((a < 0) != (b < 0))) ? q - 1 : q;
+}
+
+//Narrows [lo, hi) to the steps x for which 0 <= start + x * step < limit
+void clip_steps(long long start, long long step, long long limit, int& lo, int& hi) {
+    long long first, last;
+    if (step == 0) {
+        if (start < 0 || start >= limit) hi = lo;
+        return;
+    } else if (step > 0) {
+        first = -floor_div(start, step);
+        last = floor_div(limit - 1 - start, step);
+    } else {
+        first = -floor_div((limit - 1) - start, -step);
+        last = floor_div(start, -step);
+    }
+    lo = static_cast<int>(min<long long>(max<long long>(lo, first), hi));
+    hi = static_cast<int>(max<long long>(lo, min<long long>(hi, last + 1)));
+}
+
+//Rotates 'img' by 'theta' around its centre into 'rotated_img', a caller-owned buffer of the same size.
+//Source positions are stepped incrementally in 16.16 fixed point along each row; the span of a row that maps inside the
+//source is solved for up front, so only the black borders are filled and the inside is copied without bounds checks.
+//Row bands are rotated in parallel
+void rotate_image(const unsigned char* img, unsigned char* rotated_img, int width, int height, int channels, double theta) {
     // Center of the image
     double cx = width / 2.0;
     double cy = height / 2.0;
@@ -369,31 +1760,638 @@ unsigned char* rotate_image(const unsigned char* img, int width, int height, int
     double cos_theta = cos(theta);
     double sin_theta = sin(theta);
 
-    // Initialize the new image to black (optional)
-    fill(rotated_img, rotated_img + new_width * new_height * channels, 0);
-
-    // Iterate over each pixel in the output image
-    for (int y = 0; y < new_height; ++y) {
-        for (int x = 0; x < new_width; ++x) {
-            // Map (x, y) in the new image back to the original image
-            double new_x = (x - cx) * cos_theta + (y - cy) * sin_theta + cx;
-            double new_y = -(x - cx) * sin_theta + (y - cy) * cos_theta + cy;
-
-            // Check if the coordinates are within bounds
-            int src_x = static_cast<int>(new_x);
-            int src_y = static_cast<int>(new_y);
-            if (src_x >= 0 && src_x < width && src_y >= 0 && src_y < height) {
-                for (int c = 0; c < channels; ++c) {
-                    rotated_img[(y * new_width + x) * channels + c] =
-                        img[(src_y * width + src_x) * channels + c];
+    // Source position step per output pixel
+    const int dx = static_cast<int>(llround(cos_theta * 65536.0));
+    const int dy = static_cast<int>(llround(-sin_theta * 65536.0));
+
+    for_each_band(height, static_cast<size_t>(width) * channels, [&](int, int y0, int y1) {
+        for (int y = y0; y < y1; ++y) {
+            unsigned char* out = rotated_img + y * width * channels;
+
+            // Map (0, y) in the new image back to the original image
+            const int sx = static_cast<int>(llround((-cx * cos_theta + (y - cy) * sin_theta + cx) * 65536.0));
+            const int sy = static_cast<int>(llround((cx * sin_theta + (y - cy) * cos_theta + cy) * 65536.0));
+
+            int x0 = 0, x1 = width;
+            clip_steps(sx, dx, static_cast<long long>(width) << 16, x0, x1);
+            clip_steps(sy, dy, static_cast<long long>(height) << 16, x0, x1);
+
+            memset(out, 0, x0 * channels);
+            const int count = x1 - x0;
+            const int sx0 = sx + x0 * dx, sy0 = sy + x0 * dy;
+            unsigned char* span = out + x0 * channels;
+            if (channels >= 1 && channels <= 4) rotate_spans.span[channels](img, width, height, span, count, sx0, sy0, dx, dy);
+            memset(out + x1 * channels, 0, (width - x1) * channels);
+        }
+    });
+}
+
+//Rotates the image in 'pyramid' by 'theta' and samples it into the 'width' x 'height' cell frame 'rotated_img'.
+//Rotation happens in source pixel space, so the cell aspect ratio no longer shears the image, and every cell is a
+//bilinear sample of the pyramid level whose texels are about one cell in size. Row bands are sampled in parallel
+void rotate_mipmapped(const mip_pyramid& pyramid, unsigned char* rotated_img, int width, int height, double theta) {
+    const mip_level& level = pyramid.level;
+    const int channels = pyramid.channels;
+    const double W = pyramid.source_width, H = pyramid.source_height;
+
+    // Source pixels per cell, and texels per source pixel
+    const double fx = W / width, fy = H / height;
+    const double tx = static_cast<double>(level.width) / W, ty = static_cast<double>(level.height) / H;
+
+    double cos_theta = cos(theta);
+    double sin_theta = sin(theta);
+
+    for_each_band(height, static_cast<size_t>(width) * channels, [&](int, int y0, int y1) {
+        for (int y = y0; y < y1; ++y) {
+            unsigned char* out = rotated_img + y * width * channels;
+            const double v = (y + 0.5) * fy - H / 2.0;
+
+            // Source position of the first cell centre and its step per cell, both in source pixels
+            double su = (0.5 * fx - W / 2.0) * cos_theta + v * sin_theta + W / 2.0;
+            double sv = -(0.5 * fx - W / 2.0) * sin_theta + v * cos_theta + H / 2.0;
+            const double du = fx * cos_theta, dv = -fx * sin_theta;
+
+            for (int x = 0; x < width; ++x, out += channels, su += du, sv += dv) {
+                if (su < 0 || su >= W || sv < 0 || sv >= H) {
+                    memset(out, 0, channels);
+                    continue;
+                }
+                // Bilinear sample between the 4 nearest texel centres, clamped at the edges
+                const double lu = su * tx - 0.5, lv = sv * ty - 0.5;
+                const int u0 = static_cast<int>(floor(lu)), v0 = static_cast<int>(floor(lv));
+                const double au = lu - u0, av = lv - v0;
+                const int ua = max(u0, 0), ub = min(u0 + 1, level.width - 1);
+                const int va = max(v0, 0), vb = min(v0 + 1, level.height - 1);
+                const unsigned char* p00 = &level.pixels[(static_cast<size_t>(va) * level.width + ua) * channels];
+                const unsigned char* p01 = &level.pixels[(static_cast<size_t>(va) * level.width + ub) * channels];
+                const unsigned char* p10 = &level.pixels[(static_cast<size_t>(vb) * level.width + ua) * channels];
+                const unsigned char* p11 = &level.pixels[(static_cast<size_t>(vb) * level.width + ub) * channels];
+                for (int c = 0; c < channels; c++) {
+                    const double top = p00[c] + (p01[c] - p00[c]) * au;
+                    const double bottom = p10[c] + (p11[c] - p10[c]) * au;
+                    out[c] = static_cast<unsigned char>(top + (bottom - top) * av + 0.5);
+                }
+            }
+        }
+    });
+}
+
+//Value below which 'fraction' of the sorted 'values' lie
+long percentile(const vector<long>& sorted, double fraction) {
+    if (sorted.empty()) return 0;
+    return sorted[min(sorted.size() - 1, static_cast<size_t>(fraction * sorted.size()))];
+}
+
+//Fixed-size histogram of durations, so that an animation looping forever records its frame times without growing.
+//Values below 32 get a bucket each; above that every power of two is split into 16 buckets, about 6% wide
+struct latency_histogram{
+    static const int exact = 32;
+    static const int subBuckets = 16;
+    long counts[exact + 59 * subBuckets] = {};
+    long count = 0;
+    long sum = 0;
+
+    static int bucket(long v) {
+        if (v < exact) return static_cast<int>(max(v, 0L));
+        const int e = 63 - __builtin_clzll(static_cast<unsigned long long>(v)); //At least 5
+        return exact + (e - 5) * subBuckets + static_cast<int>((v >> (e - 4)) & (subBuckets - 1));
+    }
+
+    //Smallest value of bucket 'b'
+    static long lower_bound(int b) {
+        if (b < exact) return b;
+        const int e = (b - exact) / subBuckets + 5;
+        return static_cast<long>(subBuckets + (b - exact) % subBuckets) << (e - 4);
+    }
+
+    void add(long v) {
+        counts[bucket(v)]++;
+        count++;
+        sum += v;
+    }
+
+    //Value below which 'fraction' of the recorded values lie, to bucket precision
+    long percentile(double fraction) const {
+        const long rank = min(count - 1, static_cast<long>(fraction * count));
+        long seen = 0;
+        for (int b = 0; b < static_cast<int>(sizeof(counts) / sizeof(counts[0])); b++) {
+            seen += counts[b];
+            if (seen > rank) return lower_bound(b);
+        }
+        return 0;
+    }
+};
+
+volatile sig_atomic_t animationStopped = 0; //Set by SIGINT during an animation that loops forever
+
+void stop_animation(int) {
+    animationStopped = 1;
+}
+
+//Encoded terminal bytes of one animation frame on their way from the render thread to the writer thread
+struct frame_slot{
+    vector<char> storage;              //Preallocated for the largest frame
+    const char* bytes = nullptr;       //Either 'storage' or the cached encoding of the frame
+    size_t len = 0;
+    steady_clock::time_point deadline; //When the frame is due on screen
+    bool last = false;                 //Tells the writer that the animation is over
+};
+
+//Lock-free single-producer/single-consumer ring of frame slots. 'head' only moves on the render thread and 'tail'
+//only on the writer thread; each slot belongs to exactly one of them at a time
+struct frame_ring{
+    vector<frame_slot> slots;
+    atomic<size_t> head{0};    //Slots published by the render thread
+    atomic<size_t> tail{0};    //Slots written out by the writer thread
+    atomic<bool> failed{false};
+};
+
+//Waits for the other side of a frame_ring: spins briefly, then naps so that an idle side does not burn a core
+template <typename F>
+void wait_until(F ready) {
+    for (int spins = 0; !ready(); spins++) {
+        if (spins < 64) this_thread::yield();
+        else this_thread::sleep_for(microseconds(50));
+    }
+}
+
+//Writer thread: puts each frame of 'ring' on screen at its deadline
+void write_frames(frame_ring& ring, emit_stats& stats) {
+    for (size_t tail = 0; ; tail++) {
+        wait_until([&] { return ring.head.load(memory_order_acquire) != tail; });
+        const frame_slot& slot = ring.slots[tail % ring.slots.size()];
+        if (slot.last) return;
+        this_thread::sleep_until(slot.deadline);
+        if (slot.len > 0 && write_terminal(slot.bytes, slot.len, stats) != def) {
+            ring.failed.store(true, memory_order_release);
+            return;
+        }
+        ring.tail.store(tail + 1, memory_order_release);
+    }
+}
+
+//Plays the --rotate animation. Frame k is due at an absolute deadline of k / fps after the start, so timing errors
+//never accumulate; when a frame would start after the next one was already due, the frames whose time has passed are
+//dropped. Rendering and encoding run on this thread and hand the bytes to a writer thread through a frame_ring, so
+//a slow terminal only stalls rendering once the ring is full
+status animate(const config& settings, const palette& pal, const color_cube& cube, const unsigned char* data, const mip_pyramid& pyramid,
+               frame_buffers& buffers, emit_stats& stats) {
+    // One frame buffer for the whole animation
+    unsigned char* frame = (unsigned char*)malloc(settings.resX * settings.resY * settings.channels);
+    const int frames_per_revolution = max(1, static_cast<int>(lround(settings.fps / settings.rotateSpeed)));
+    const long total = static_cast<long>(settings.rotations) * frames_per_revolution; //0 means forever
+    frame_cache cache;
+    const bool caching = init_frame_cache(settings, frames_per_revolution, cache);
+    if (settings.verbose) cout << frames_per_revolution << " frames per revolution, " << (caching ? "cached" : "not cached") << '\n';
+
+    prepare_frame_buffers(settings, buffers);
+    frame_ring ring;
+    ring.slots.resize(pipelineDepth);
+    for (frame_slot& slot : ring.slots) slot.storage.resize(settings.terminal ? buffers.out.size() : 0);
+    cout.flush();
+    thread writer(write_frames, ref(ring), ref(stats));
+
+    latency_histogram frame_times; //Microseconds spent producing each frame
+    if (total == 0) signal(SIGINT, stop_animation); //Interrupting is the only way out, so still report the frame times
+    long dropped = 0;
+    int last_index = -1; //Frame last handed to the writer
+    status stat = def;
+
+    const duration<double> period(1.0 / settings.fps);
+    const steady_clock::time_point t0 = steady_clock::now();
+    size_t head = 0;
+    for (long k = 0; (total == 0 && !animationStopped) || k < total; k++) {
+        // Skip ahead to the frame that is due now if the next one is already late
+        long due = static_cast<long>(duration<double>(steady_clock::now() - t0) / period);
+        if (total > 0) due = min(due, total - 1);
+        if (due > k) {
+            dropped += due - k;
+            k = due;
+        }
+
+        // Claim a free slot
+        wait_until([&] { return head - ring.tail.load(memory_order_acquire) < ring.slots.size() || ring.failed.load(memory_order_acquire); });
+        if (ring.failed.load(memory_order_acquire)) { stat = err; break; }
+        frame_slot& slot = ring.slots[head % ring.slots.size()];
+
+        steady_clock::time_point start = steady_clock::now();
+        const int index = static_cast<int>(k % frames_per_revolution);
+        const bool follows = last_index == (index + frames_per_revolution - 1) % frames_per_revolution;
+        slot.bytes = slot.storage.data();
+        slot.len = 0;
+
+        if (caching && follows && cache.frames[index].has_encoded && !settings.output) {
+            replay_frame(settings, cache.frames[index], buffers);
+            slot.bytes = cache.frames[index].encoded.data();
+            slot.len = cache.frames[index].encoded.size();
+        } else {
+            if (caching && cache.frames[index].has_grid) {
+                buffers.grid.glyphs = cache.frames[index].grid.glyphs;
+                buffers.grid.colors = cache.frames[index].grid.colors;
+            } else {
+                const double theta = 2.0 * M_PI * index / frames_per_revolution;
+                if (settings.antialias) rotate_mipmapped(pyramid, frame, settings.resX, settings.resY, theta);
+                else rotate_image(data, frame, settings.resX, settings.resY, settings.channels, theta);
+                stat = render_frame(settings, pal, frame, buffers);
+                if (stat != def) break;
+                if (caching) {
+                    cache.frames[index].grid = buffers.grid;
+                    cache.frames[index].has_grid = true;
                 }
             }
+            if (settings.terminal) {
+                slot.len = encode_terminal(settings, cube, buffers, slot.storage.data(), stats) - slot.storage.data();
+                if (caching && follows) cache_encoded(slot.bytes, slot.len, cache, cache.frames[index]);
+            }
+            if (settings.output) {
+                stat = write_output(settings, settings.terminal ? buffers.previous : buffers.grid, buffers.out.data());
+                if (stat != def) break;
+            }
+        }
+        last_index = index;
+        frame_times.add(duration_cast<microseconds>(steady_clock::now() - start).count());
+
+        // Hand the frame to the writer
+        slot.deadline = t0 + duration_cast<steady_clock::duration>(period * k);
+        slot.last = false;
+        ring.head.store(++head, memory_order_release);
+    }
+
+    // Let the writer drain the ring and stop, unless it already gave up
+    wait_until([&] { return head - ring.tail.load(memory_order_acquire) < ring.slots.size() || ring.failed.load(memory_order_acquire); });
+    if (!ring.failed.load(memory_order_acquire)) {
+        ring.slots[head % ring.slots.size()].last = true;
+        ring.head.store(++head, memory_order_release);
+    }
+    writer.join();
+    signal(SIGINT, SIG_DFL);
+    free(frame);
+    if (ring.failed.load()) stat = err;
+    if (stat != def) return stat;
+
+    // Give the last frame its period on screen before the upright frame replaces it
+    this_thread::sleep_until(t0 + duration_cast<steady_clock::duration>(period * total));
+    stat = produce_ascii(settings, pal, cube, data, buffers, stats); //Final frame, so that the last frame is always precisely upright
+
+    cout << "Average frametime: " << frame_times.sum / static_cast<double>(max(1L, frame_times.count)) << " microseconds (p50 "
+         << frame_times.percentile(0.50) << ", p95 " << frame_times.percentile(0.95) << ", p99 " << frame_times.percentile(0.99)
+         << "), dropped " << dropped << " of " << dropped + frame_times.count << " frames" << '\n';
+    return stat;
+}
+
+//One image of a batch
+struct batch_job{
+    string input;
+    string output;
+};
+
+//Default output of a batch image: output/<file name without extension>.txt
+string batch_output(const string& input) {
+    const size_t slash = input.find_last_of('/');
+    string name = (slash == string::npos) ? input : input.substr(slash + 1);
+    const size_t dot = name.find_last_of('.');
+    if (dot != string::npos && dot > 0) name.erase(dot);
+    return "output/" + name + ".txt";
+}
+
+//Expands --batch into jobs: every file of a directory, every match of a glob, or the lines of a manifest
+bool list_batch(const string& spec, vector<batch_job>& jobs) {
+    struct stat info;
+    if (spec.find_first_of("*?[") != string::npos) {
+        glob_t matches;
+        if (glob(spec.c_str(), 0, nullptr, &matches) == 0)
+            for (size_t i = 0; i < matches.gl_pathc; i++) jobs.push_back({matches.gl_pathv[i], batch_output(matches.gl_pathv[i])});
+        globfree(&matches);
+    } else if (stat(spec.c_str(), &info) == 0 && S_ISDIR(info.st_mode)) {
+        DIR* dir = opendir(spec.c_str());
+        if (!dir) return false;
+        while (dirent* entry = readdir(dir)) {
+            const string path = spec + "/" + entry->d_name;
+            if (entry->d_name[0] != '.' && stat(path.c_str(), &info) == 0 && S_ISREG(info.st_mode))
+                jobs.push_back({path, batch_output(path)});
+        }
+        closedir(dir);
+        sort(jobs.begin(), jobs.end(), [](const batch_job& a, const batch_job& b) { return a.input < b.input; });
+    } else {
+        ifstream manifest(spec);
+        if (!manifest.is_open()) return false;
+        string line;
+        while (getline(manifest, line)) {
+            const size_t start = line.find_first_not_of(" \t");
+            if (start == string::npos || line[start] == '#') continue;
+            const size_t split = line.find_first_of(" \t", start);
+            const string input = line.substr(start, split - start);
+            const size_t output = (split == string::npos) ? string::npos : line.find_first_not_of(" \t", split);
+            const size_t end = (output == string::npos) ? string::npos : line.find_last_not_of(" \t\r");
+            jobs.push_back({input, (output == string::npos) ? batch_output(input) : line.substr(output, end + 1 - output)});
         }
     }
+    return true;
+}
+
+//A worker's share of the batch. The owner takes jobs from the back, idle workers steal from the front
+struct work_queue{
+    mutex lock;
+    deque<int> jobs;
+};
+
+//Takes the next job for worker 'self': its own newest, else the oldest of the first other worker that has one
+bool next_job(vector<work_queue>& queues, int self, int& job) {
+    for (size_t k = 0; k < queues.size(); k++) {
+        work_queue& queue = queues[(self + k) % queues.size()];
+        lock_guard<mutex> guard(queue.lock);
+        if (queue.jobs.empty()) continue;
+        if (k == 0) { job = queue.jobs.back(); queue.jobs.pop_back(); }
+        else { job = queue.jobs.front(); queue.jobs.pop_front(); }
+        return true;
+    }
+    return false;
+}
+
+//Converts every image of --batch on --threads workers that share the palette. Images vary a lot in size, so every
+//worker starts with an equal slice of the jobs and steals from the others once its own run out. Each worker keeps its
+//frame buffers and resize samplers across images; rendering within an image stays on the worker's thread
+status run_batch(const config& settings, const palette& pal, const color_cube& cube) {
+    vector<batch_job> jobs;
+    if (!list_batch(settings.batch, jobs) || jobs.empty()) {
+        cerr << "No images found for batch: " << settings.batch << '\n';
+        return err;
+    }
 
-    return rotated_img;
+    const int workers = max(1, min(settings.threads, static_cast<int>(jobs.size())));
+    vector<work_queue> queues(workers);
+    for (size_t i = 0; i < jobs.size(); i++) queues[i * workers / jobs.size()].jobs.push_back(static_cast<int>(i));
+
+    vector<long> latencies(jobs.size(), -1); //Microseconds per image, -1 if it failed
+    const steady_clock::time_point start = steady_clock::now();
+    auto work = [&](int self) {
+        config image_settings = settings;
+        image_settings.verbose = false;
+        frame_buffers buffers;
+        resizer samplers;
+        emit_stats stats;
+        for (int job; next_job(queues, self, job); ) {
+            steady_clock::time_point image_start = steady_clock::now();
+            image_settings.filename = jobs[job].input;
+            image_settings.output_file = jobs[job].output;
+            unsigned char* data = nullptr;
+            if (load_and_process_image(image_settings, &data, nullptr, &samplers) != def) continue;
+            const status stat = produce_ascii(image_settings, pal, cube, data, buffers, stats);
+            free(data);
+            if (stat == def) latencies[job] = duration_cast<microseconds>(steady_clock::now() - image_start).count();
+        }
+    };
+    vector<thread> threads;
+    for (int self = 1; self < workers; self++) threads.emplace_back(work, self);
+    work(0);
+    for (thread& worker : threads) worker.join();
+    const double seconds = duration<double>(steady_clock::now() - start).count();
+
+    vector<long> done;
+    for (long latency : latencies) if (latency >= 0) done.push_back(latency);
+    sort(done.begin(), done.end());
+    cout << done.size() << " of " << jobs.size() << " images in " << seconds << " s on " << workers << " thread(s): "
+         << done.size() / seconds << " images/s, latency p50 " << percentile(done, 0.50) << ", p95 " << percentile(done, 0.95)
+         << ", p99 " << percentile(done, 0.99) << " microseconds" << '\n';
+    return done.size() == jobs.size() ? def : err;
 }
 
+//Glyph palettes by glyph count and inversion, compiled on first use and kept for later requests. Count 0 stands for
+//the palette of the command line
+struct palette_cache{
+    mutex lock;
+    map<pair<int, bool>, palette> palettes;
+};
+
+const palette& cached_palette(palette_cache& cache, int count, bool invert) {
+    lock_guard<mutex> guard(cache.lock);
+    auto found = cache.palettes.find({count, invert});
+    if (found != cache.palettes.end()) return found->second;
+    string chars = (count == 0) ? ascii_chars : figure_out_chars(count);
+    if (invert) reverse(chars.begin(), chars.end());
+    return cache.palettes.emplace(make_pair(count, invert), compile_palette(chars)).first->second;
+}
+
+//Buffered reads from a client of --serve
+struct client_stream{
+    int fd;
+    vector<unsigned char> buffer;
+    size_t begin = 0;
+    size_t end = 0;
+};
+
+//Reads until 'count' bytes are buffered after 'begin'. False if the client is gone first
+bool fill_stream(client_stream& in, size_t count) {
+    if (in.end - in.begin >= count) return true;
+    if (in.begin > 0) {
+        memmove(in.buffer.data(), in.buffer.data() + in.begin, in.end - in.begin);
+        in.end -= in.begin;
+        in.begin = 0;
+    }
+    if (in.buffer.size() < count) in.buffer.resize(max<size_t>(count, 64 * 1024));
+    while (in.end < count) {
+        ssize_t n = read(in.fd, in.buffer.data() + in.end, in.buffer.size() - in.end);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        in.end += n;
+    }
+    return true;
+}
+
+//Reads a line of at most maxRequestHeader bytes, without its newline
+bool read_line(client_stream& in, string& line) {
+    for (size_t scanned = 0; ; ) {
+        const unsigned char* start = in.buffer.data() + in.begin;
+        const unsigned char* newline = static_cast<const unsigned char*>(memchr(start + scanned, '\n', in.end - in.begin - scanned));
+        if (newline) {
+            line.assign(reinterpret_cast<const char*>(start), newline - start);
+            in.begin += newline - start + 1;
+            return true;
+        }
+        scanned = in.end - in.begin;
+        if (scanned >= maxRequestHeader || !fill_stream(in, scanned + 1)) return false;
+    }
+}
+
+//Applies the options of a request line to 'settings'. Returns the image size, or 0 with 'error' set
+size_t parse_request(const string& line, config& settings, int& chars, string& error) {
+    size_t size = 0;
+    for (size_t pos = 0; pos < line.size(); ) {
+        const size_t end = min(line.find(' ', pos), line.size());
+        const string option = line.substr(pos, end - pos);
+        pos = end + 1;
+        if (option.empty()) continue;
+        const size_t eq = option.find('=');
+        const string key = option.substr(0, eq), value = (eq == string::npos) ? "" : option.substr(eq + 1);
+        try {
+            if (key == "size") size = stoul(value);
+            else if (key == "width") settings.resX = stoi(value);
+            else if (key == "chars") chars = stoi(value);
+            else if (key == "invert") settings.invert = value == "1";
+            else if (key == "tolerance") settings.colorTolerance = stoi(value);
+            else if (key == "colors") {
+                settings.terminal = value != "none";
+                if (value == "truecolor") settings.colors = truecolor;
+                else if (value == "256") settings.colors = ansi256;
+                else if (value == "16") settings.colors = ansi16;
+                else if (value != "none") { error = "unknown colour mode " + value; return 0; }
+            } else { error = "unknown option " + key; return 0; }
+        } catch (const exception&) {
+            error = "invalid value for " + key;
+            return 0;
+        }
+    }
+    if (size == 0 || size > maxRequestBytes) error = "size missing or out of range";
+    else if (settings.resX < 1 || settings.resX > maxRequestWidth || chars < 0 || chars == 1 || chars > maxGlyphs) error = "width or chars out of range";
+    else if (settings.colorTolerance < 0 || settings.colorTolerance > maxColorTolerance) error = "tolerance out of range";
+    else return size;
+    return 0;
+}
+
+//Sends all 'len' bytes to a client, giving up once the client has taken nothing for serveIdleSeconds
+bool send_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(fd, data, len, MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return false;
+            pollfd writable = {fd, POLLOUT, 0};
+            int ready;
+            while ((ready = poll(&writable, 1, serveIdleSeconds * 1000)) < 0 && errno == EINTR) {}
+            if (ready <= 0) return false;
+            continue;
+        }
+        data += sent;
+        len -= sent;
+    }
+    return true;
+}
+
+//Sends the answer header and 'len' bytes of art, or just an error
+bool send_answer(int fd, const char* bytes, size_t len, const string& error) {
+    const string header = error.empty() ? "ok " + to_string(len) + "\n" : "error " + error + "\n";
+    return send_all(fd, header.data(), header.size()) && (!error.empty() || send_all(fd, bytes, len));
+}
+
+//Connections accepted by --serve and waiting for a worker
+struct connection_queue{
+    mutex lock;
+    condition_variable ready;
+    condition_variable space;
+    deque<int> fds;
+};
+
+//State that a --serve worker keeps warm across requests
+struct serve_worker{
+    frame_buffers buffers;
+    resizer samplers;
+    emit_stats stats;
+};
+
+//Answers the requests of one client until it hangs up
+void serve_client(const config& settings, palette_cache& palettes, const color_cube* cubes, serve_worker& worker, int fd) {
+    client_stream in{fd, {}, 0, 0};
+    string line;
+    while (read_line(in, line)) {
+        config request = settings;
+        request.verbose = false;
+        request.output = false;
+        request.resY = 0;
+        int chars = 0;
+        string error;
+        const size_t size = parse_request(line, request, chars, error);
+        if (size == 0) { send_answer(fd, nullptr, 0, error); return; }
+        if (!fill_stream(in, size)) return;
+
+        image_input input(in.buffer.data() + in.begin, size);
+        unsigned char* data = nullptr;
+        status stat = process_input(request, input, "request", &data, nullptr, &worker.samplers);
+        in.begin += size;
+        if (stat == def) stat = render_frame(request, cached_palette(palettes, chars, request.invert), data, worker.buffers);
+        free(data);
+        if (stat != def) {
+            if (!send_answer(fd, nullptr, 0, (request.resY < 1) ? "image too wide for width" : "could not render image")) return;
+            continue;
+        }
+        char* out = worker.buffers.out.data();
+        char* end = request.terminal ? emit_ansi(request, cubes[request.colors], worker.buffers.grid, nullptr, out, worker.buffers, worker.stats)
+                                     : emit_plain(worker.buffers.grid, out);
+        if (!send_answer(fd, out, end - out, "")) return;
+    }
+}
+
+const char* servedSocket = nullptr; //Removed again when the daemon is stopped
+
+void stop_serving(int) {
+    if (servedSocket) unlink(servedSocket);
+    _exit(0);
+}
+
+//Runs the render daemon of --serve: the calling thread accepts connections into a bounded queue and --threads workers
+//answer them one client at a time. A worker belongs to its client until the client hangs up, or until a read or write
+//makes no progress for serveIdleSeconds, so idle connections hold up the queue for at most that long. Palettes, colour cubes, frame buffers
+//and resize samplers all stay warm
+status serve(const config& settings) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (settings.socket.size() >= sizeof(address.sun_path)) {
+        cerr << "Socket path too long: " << settings.socket << '\n';
+        return err;
+    }
+    strcpy(address.sun_path, settings.socket.c_str());
+    const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct stat existing;
+    if (lstat(settings.socket.c_str(), &existing) == 0 && S_ISSOCK(existing.st_mode)) unlink(settings.socket.c_str()); //Left by an earlier daemon
+    if (listener < 0 || ::bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, serveBacklog) != 0) {
+        cerr << "Failed to listen on " << settings.socket << ": " << strerror(errno) << '\n';
+        return err;
+    }
+    servedSocket = settings.socket.c_str();
+    signal(SIGPIPE, SIG_IGN); //A client hanging up early must not end the daemon
+    signal(SIGINT, stop_serving);
+    signal(SIGTERM, stop_serving);
+
+    palette_cache palettes;
+    const color_cube cubes[] = {compile_color_cube(truecolor), compile_color_cube(ansi256), compile_color_cube(ansi16)};
+    connection_queue queue;
+    vector<thread> workers;
+    for (int w = 0; w < settings.threads; w++) {
+        workers.emplace_back([&] {
+            serve_worker worker;
+            while (true) {
+                unique_lock<mutex> guard(queue.lock);
+                queue.ready.wait(guard, [&] { return !queue.fds.empty(); });
+                const int fd = queue.fds.front();
+                queue.fds.pop_front();
+                guard.unlock();
+                queue.space.notify_one();
+                serve_client(settings, palettes, cubes, worker, fd);
+                close(fd);
+            }
+        });
+    }
+    if (settings.verbose) cout << "Serving on " << settings.socket << " with " << settings.threads << " worker(s)" << '\n';
+
+    while (true) {
+        const int fd = accept(listener, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            cerr << "Failed to accept a connection: " << strerror(errno) << '\n';
+            break;
+        }
+        const timeval idle = {serveIdleSeconds, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+        unique_lock<mutex> guard(queue.lock);
+        queue.space.wait(guard, [&] { return queue.fds.size() < static_cast<size_t>(serveBacklog); });
+        queue.fds.push_back(fd);
+        guard.unlock();
+        queue.ready.notify_one();
+    }
+    unlink(settings.socket.c_str());
+    _exit(1); //Workers block on the queue forever
+}
+
+#ifndef ASCII_LIBRARY
 int main(int argc, char* argv[]) {
     // Load default parameters
     config settings;
@@ -406,14 +2404,26 @@ int main(int argc, char* argv[]) {
         case def: break;
     }
 
+    // Keep stdout for the ASCII art when it goes there; logging moves to stderr
+    if (settings.output && settings.output_file == streamName) cout.rdbuf(cerr.rdbuf());
+
     if (ascii_chars.empty()) ascii_chars = figure_out_chars(settings.no_of_ascii);
+    if (settings.batch.empty() && settings.socket.empty()) start_pool(pool, settings.threads); //Batches and --serve spread work over threads instead
 
     if (settings.verbose) cout << "selected ascii character palette: " << ascii_chars << '\n';
+    if (!settings.socket.empty()) return serve(settings) == def ? 0 : 1;
     
     if (settings.invert) reverse(ascii_chars.begin(), ascii_chars.end());
+
+    const palette pal = compile_palette(ascii_chars);
+    const color_cube cube = compile_color_cube(settings.colors);
+    if (!settings.batch.empty()) return run_batch(settings, pal, cube) == def ? 0 : 1;
+    emit_stats stats;
+    frame_buffers buffers;
     
     unsigned char* data = nullptr;
-    stat = load_and_process_image(settings, &data);
+    mip_pyramid pyramid;
+    stat = load_and_process_image(settings, &data, &pyramid);
     switch(stat){
         case err: return 1;
         case h: free(data); return 0;
@@ -421,28 +2431,14 @@ int main(int argc, char* argv[]) {
     }
 
     if (settings.rotateSpeed > 0) {
-        double iterations_per_rotation = framerate / static_cast<double>(settings.rotateSpeed);
-        double rotation_per_iteration = 2.0 * M_PI / iterations_per_rotation;
-        int sum = 0;
-        for (double theta = 0; theta < rotations * 2.0 * M_PI; theta += rotation_per_iteration) {
-            steady_clock::time_point start = high_resolution_clock::now();
-            stat = produce_ascii(settings, rotate_image(data, settings.resX, settings.resY, settings.channels, theta));
-            switch(stat) {
-                case err: free(data); return 1;
-                case h: free(data); return 0;
-                case def: break;
-            }
-
-            steady_clock::time_point end = high_resolution_clock::now();
-            sum+= duration_cast<microseconds>(end-start).count();
-            this_thread::sleep_for(milliseconds(static_cast<int>(1000.0 / framerate)) - (end - start));
+        stat = animate(settings, pal, cube, data, pyramid, buffers, stats);
+        switch(stat) {
+            case err: free(data); return 1;
+            case h: free(data); return 0;
+            case def: break;
         }
-
-        produce_ascii(settings, data); //Final frame, so that the last frame is always precisely upright
-        cout << "Average frametime: " << sum / (iterations_per_rotation*rotations) << " microseconds (" << sum / (1000*iterations_per_rotation * rotations)  << " ms)" << '\n';
-
     } else {
-        stat = produce_ascii(settings, rotate_image(data, settings.resX, settings.resY, settings.channels, 0));
+        stat = produce_ascii(settings, pal, cube, data, buffers, stats);
         switch(stat) {
             case err: free(data); return 1;
             case h: free(data); return 0;
@@ -450,6 +2446,9 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    if (settings.terminal && (settings.verbose || settings.colorTolerance > 0)) print_emit_stats(settings, stats);
+
     free(data);
     return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -0,0 +1,142 @@
+//Microbenchmarks for the hot loops of asciiart. Build and run with 'make bench'
+#define main asciiart_main
+#include "asciiart.cpp"
+#undef main
+
+#include <dirent.h>
+
+const int benchWidth = 256;
+const int benchIterations = 200;
+
+//Lists every file in img/, sorted so runs are comparable
+vector<string> bench_corpus() {
+    vector<string> res;
+    DIR* dir = opendir("img");
+    if (!dir) { cerr << "img/ could not be opened." << '\n'; return res; }
+    while (dirent* entry = readdir(dir)) {
+        string name = entry->d_name;
+        if (name[0] != '.') res.push_back("img/" + name);
+    }
+    closedir(dir);
+    sort(res.begin(), res.end());
+    return res;
+}
+
+//Mapping as it was before the compiled palette: float luminance and a divide per pixel
+void map_legacy(const config& settings, const unsigned char* data, char* out) {
+    for (int i = 0; i < settings.resX * settings.resY; i++) {
+        const unsigned char* px = data + i * settings.channels;
+        unsigned char r = px[0], g = px[0], b = px[0];
+        if (settings.channels >= 3) { g = px[1]; b = px[2]; }
+        unsigned char grayscale_value = static_cast<unsigned char>(0.299f * r + 0.587f * g + 0.114f * b);
+        out[i] = ascii_chars[grayscale_value * ascii_chars.size() / 256];
+    }
+}
+
+//Mapping through the compiled palette with a given luminance kernel
+void map_palette(const config& settings, const palette& pal, luma_kernel kernel, const unsigned char* data, unsigned char* gray, char* out) {
+    for (int y = 0; y < settings.resY; y++) {
+        kernel(data + y * settings.resX * settings.channels, gray, settings.resX, settings.channels);
+        for (int x = 0; x < settings.resX; x++) out[y * settings.resX + x] = pal.glyphs[gray[x]];
+    }
+}
+
+//Rotation as it was before the fixed-point rasterizer: two double transforms and a bounds check per pixel
+void rotate_legacy(const unsigned char* img, unsigned char* rotated_img, int width, int height, int channels, double theta) {
+    double cx = width / 2.0, cy = height / 2.0;
+    double cos_theta = cos(theta), sin_theta = sin(theta);
+    fill(rotated_img, rotated_img + width * height * channels, 0);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            double new_x = (x - cx) * cos_theta + (y - cy) * sin_theta + cx;
+            double new_y = -(x - cx) * sin_theta + (y - cy) * cos_theta + cy;
+            int src_x = static_cast<int>(new_x);
+            int src_y = static_cast<int>(new_y);
+            if (src_x >= 0 && src_x < width && src_y >= 0 && src_y < height) {
+                for (int c = 0; c < channels; ++c)
+                    rotated_img[(y * width + x) * channels + c] = img[(src_y * width + src_x) * channels + c];
+            }
+        }
+    }
+}
+
+//Runs 'fn' benchIterations times and returns nanoseconds per pixel
+template <typename F>
+double time_per_pixel(const config& settings, F fn) {
+    steady_clock::time_point start = steady_clock::now();
+    for (int it = 0; it < benchIterations; it++) fn();
+    steady_clock::time_point end = steady_clock::now();
+    return duration_cast<nanoseconds>(end - start).count() / (double(benchIterations) * settings.resX * settings.resY);
+}
+
+int main() {
+    ascii_chars = figure_out_chars(no_of_ascii_default * 4);
+    const palette pal = compile_palette(ascii_chars);
+
+    cout << "image                          legacy ns/px  palette ns/px  simd ns/px  speedup\n";
+    for (const string& file : bench_corpus()) {
+        config settings;
+        settings.filename = file;
+        settings.resX = benchWidth;
+        unsigned char* data = nullptr;
+        if (load_and_process_image(settings, &data) != def) continue;
+
+        vector<char> out(settings.resX * settings.resY);
+        vector<unsigned char> gray(settings.resX);
+        double before = time_per_pixel(settings, [&] { map_legacy(settings, data, out.data()); });
+        double scalar = time_per_pixel(settings, [&] { map_palette(settings, pal, luma_row_scalar, data, gray.data(), out.data()); });
+        double simd = time_per_pixel(settings, [&] { map_palette(settings, pal, luma_row, data, gray.data(), out.data()); });
+
+        printf("%-30s %12.3f %14.3f %11.3f %8.2fx\n", file.c_str(), before, scalar, simd, before / simd);
+        free(data);
+    }
+
+    cout << "\nimage                          legacy rotate ns/px  rotate ns/px  speedup\n";
+    for (const string& file : bench_corpus()) {
+        config settings;
+        settings.filename = file;
+        settings.resX = benchWidth;
+        unsigned char* data = nullptr;
+        if (load_and_process_image(settings, &data) != def) continue;
+
+        vector<unsigned char> frame(settings.resX * settings.resY * settings.channels);
+        double theta = 0;
+        double before = time_per_pixel(settings, [&] { rotate_legacy(data, frame.data(), settings.resX, settings.resY, settings.channels, theta += 0.1); });
+        double after = time_per_pixel(settings, [&] { rotate_image(data, frame.data(), settings.resX, settings.resY, settings.channels, theta += 0.1); });
+
+        printf("%-30s %19.3f %13.3f %8.2fx\n", file.c_str(), before, after, before / after);
+        free(data);
+    }
+
+    cout << "\nimage                          resize ns/px  cached samplers ns/px  area ns/px  speedup\n";
+    for (const string& file : bench_corpus()) {
+        int width, height, channels;
+        unsigned char* source = stbi_load(file.c_str(), &width, &height, &channels, 0);
+        if (!source) continue;
+        const stbir_pixel_layout layouts[] = {STBIR_1CHANNEL, STBIR_1CHANNEL, STBIR_2CHANNEL, STBIR_RGB, STBIR_RGBA};
+        config settings;
+        settings.resX = benchWidth;
+        settings.resY = grid_rows(benchWidth, width, height);
+        vector<unsigned char> out(settings.resX * settings.resY * channels);
+
+        double before = time_per_pixel(settings, [&] {
+            stbir_resize(source, width, height, 0, out.data(), settings.resX, settings.resY, 0, layouts[channels], STBIR_TYPE_UINT8,
+                         STBIR_EDGE_CLAMP, STBIR_FILTER_DEFAULT);
+        });
+        resizer samplers;
+        double after = time_per_pixel(settings, [&] {
+            resize_image(samplers, source, width, height, out.data(), settings.resX, settings.resY, layouts[channels]);
+        });
+
+        if (width >= settings.resX * areaDownscaleRatio && height >= settings.resY * areaDownscaleRatio) {
+            double area = time_per_pixel(settings, [&] {
+                area_downscale(source, width, height, channels, out.data(), settings.resX, settings.resY);
+            });
+            printf("%-30s %12.3f %22.3f %11.3f %8.2fx\n", file.c_str(), before, after, area, before / area);
+        } else {
+            printf("%-30s %12.3f %22.3f %11s %8.2fx\n", file.c_str(), before, after, "-", before / after);
+        }
+        stbi_image_free(source);
+    }
+    return 0;
+}
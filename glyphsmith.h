@@ -0,0 +1,90 @@
+//libglyphsmith: the asciiart render pipeline as a library. Build with 'make lib'.
+//A Renderer keeps its compiled palette, colour tables, scratch buffers and resize samplers across calls and shares no
+//mutable state with other Renderers, so one Renderer per thread runs without locks
+#ifndef GLYPHSMITH_H
+#define GLYPHSMITH_H
+
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#define GLYPHSMITH_API __attribute__((visibility("default")))
+
+namespace glyphsmith {
+
+//Decoded pixels with 1 (gray), 2 (gray+alpha), 3 (RGB) or 4 (RGBA) interleaved channels. Alpha is ignored
+struct Image{
+    const unsigned char* pixels = nullptr;
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+};
+
+//Output of the render pipeline, independent of how it gets emitted: a glyph and a packed 0xRRGGBB colour per cell,
+//stored as separate planes so that emitters and diffing only touch what they need
+struct CellGrid{
+    int width = 0;
+    int height = 0;
+    std::vector<char> glyphs;
+    std::vector<unsigned int> colors;
+
+    void resize(int w, int h) {
+        width = w;
+        height = h;
+        glyphs.resize(static_cast<size_t>(w) * h);
+        colors.resize(static_cast<size_t>(w) * h);
+    }
+
+    //True if row 'y' holds the same cells in both grids
+    bool same_row(const CellGrid& other, int y) const {
+        const size_t start = static_cast<size_t>(y) * width;
+        return memcmp(&glyphs[start], &other.glyphs[start], width) == 0 &&
+               memcmp(&colors[start], &other.colors[start], width * sizeof(unsigned int)) == 0;
+    }
+};
+
+enum class ColorMode{ none, ansi16, ansi256, truecolor };
+
+//What a Renderer produces; the counterparts of the command line options
+struct Options{
+    int width = 128;                        //Columns; rows follow from the image aspect ratio and the cell shape
+    std::string glyphs;                     //Glyphs for dark to bright pixels, as --chars. Empty picks 'glyph_count' glyphs
+    int glyph_count = 4;                    //(2 to 94) as -# does, from a built-in copy of charsizes.txt
+    bool invert = false;
+    ColorMode colors = ColorMode::truecolor; //none renders glyphs only and skips all colour work
+    int color_tolerance = 0;                //As --color-tolerance, clamped to 0 to 765
+};
+
+class GLYPHSMITH_API Renderer{
+public:
+    explicit Renderer(const Options& options);
+    ~Renderer();
+    Renderer(const Renderer&) = delete;
+    Renderer& operator=(const Renderer&) = delete;
+
+    //Resizes 'image' to the cell grid and maps it into 'grid', reusing the grid's storage. False if the image is unusable
+    bool render(const Image& image, CellGrid& grid);
+    //Decodes an encoded image (PNG, JPEG, ...) and renders it like render()
+    bool render_encoded(const unsigned char* bytes, size_t size, CellGrid& grid);
+
+    //Most bytes the emitters write for a 'width' x 'height' grid
+    static size_t plain_capacity(int width, int height);
+    static size_t ansi_capacity(int width, int height);
+
+    //Write 'grid' into 'out', which must hold the capacity above, and return the bytes written. emit_plain writes the
+    //glyphs a line per row; emit_ansi writes terminal escapes and, given the 'previous' grid of the same size that is on
+    //screen, only redraws the cells that changed. With ColorMode::none, emit_ansi moves the cursor home (clearing the
+    //screen first without 'previous') and redraws every glyph uncoloured
+    size_t emit_plain(const CellGrid& grid, char* out) const;
+    size_t emit_ansi(const CellGrid& grid, const CellGrid* previous, char* out);
+
+private:
+    struct state;
+    std::unique_ptr<state> impl;
+};
+
+}
+
+#endif